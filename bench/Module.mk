@@ -0,0 +1,38 @@
+################ Source files ##########################################
+
+bench/srcs	:= $(wildcard bench/*.cc)
+bench/bins	:= $(addprefix $O,$(bench/srcs:.cc=))
+bench/objs	:= $(addprefix $O,$(bench/srcs:.cc=.o))
+bench/deps	:= ${bench/objs:.o=.d}
+
+################ Compilation ###########################################
+
+.PHONY:	bench/all bench/run bench/clean bench
+
+bench/all:	${bench/bins}
+
+# Each benchmark prints one tab-separated "name value unit" line
+# per measurement, to be easily compared between releases.
+#
+bench:		bench/run
+bench/run:	${bench/bins}
+	@for i in ${bench/bins}; do \
+	    TERM=xterm COLUMNS=80 LINES=24 $$i; \
+	done
+
+${bench/bins}: $Obench/%: $Obench/%.o ${liba}
+	@echo "Linking $@ ..."
+	@${CC} ${ldflags} -o $@ $^ ${libs}
+
+################ Maintenance ###########################################
+
+clean:	bench/clean
+bench/clean:
+	@if [ -d ${builddir}/bench ]; then\
+	    rm -f ${bench/bins} ${bench/objs} ${bench/deps} $Obench/.d;\
+	    rmdir ${builddir}/bench;\
+	fi
+
+${bench/objs}:	Makefile bench/Module.mk ${confs} $Obench/.d
+
+-include ${bench/deps}
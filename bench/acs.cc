@@ -0,0 +1,39 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "bench.h"
+
+/// The linear scan of c_AcscInfo replaced by the lookup table.
+static wchar_t LinearSubstituteChar (wchar_t c)
+{
+    for (uoff_t i = 0; i < acs_Last; ++i)
+	if (CTerminfo::AcsUnicodeValue (EGraphicChar(i)) == c)
+	    return i;
+    return c;
+}
+
+/// Measures the per-cell cost of ACS substitution on a box-drawing frame.
+int main (void)
+{
+    CTerminfo term;
+    term.Load();
+    // A typical box-heavy row: corners, lines, tees, and some text.
+    static const wchar_t c_Row[] = {
+	acsv_UpperLeftCorner, acsv_HLine, acsv_HLine, acsv_TopTee, acsv_HLine, acsv_UpperRightCorner,
+	acsv_VLine, 'a', 'b', acsv_VLine, acsv_Block, acsv_VLine,
+	acsv_LeftTee, acsv_HLine, acsv_Plus, acsv_HLine, acsv_HLine, acsv_RightTee,
+	acsv_LowerLeftCorner, acsv_HLine, acsv_BottomTee, acsv_HLine, acsv_Board, acsv_LowerRightCorner
+    };
+    volatile wchar_t sink = 0;	// Keeps the loops from being optimized out
+    BenchItems ("acs/linear", [&]{
+	for (auto c : c_Row)
+	    sink = LinearSubstituteChar (c);
+    }, VectorSize(c_Row), "ns/cell");
+    BenchItems ("acs/table", [&]{
+	for (auto c : c_Row)
+	    sink = term.SubstituteChar (c);
+    }, VectorSize(c_Row), "ns/cell");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,48 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+//
+// Timing harness for the benchmarks. Each measurement prints one line
+// of "name<TAB>value<TAB>unit", so the output can be diffed and parsed.
+
+#pragma once
+#include "../ti.h"
+#include <time.h>
+using namespace utio;
+using namespace ustl;
+
+/// Returns the monotonic clock value in nanoseconds.
+inline uint64_t BenchNow (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/// Prints measurement \p v of \p name in \p unit.
+inline void BenchReport (const char* name, double v, const char* unit)
+{
+    cout.format ("%s\t%.1f\t%s\n", name, v, unit);
+}
+
+/// Calls \p f until at least \p mintime ns elapse and reports the ns per each of \p nItems processed by a call.
+template <typename F>
+void BenchItems (const char* name, F f, size_t nItems, const char* unit, uint64_t mintime = 100000000)
+{
+    f();	// Warm up caches and buffers.
+    uint64_t n = 0, elapsed = 0;
+    for (uint64_t batch = 1; elapsed < mintime; batch *= 2) {
+	const auto start = BenchNow();
+	for (uint64_t i = 0; i < batch; ++i)
+	    f();
+	elapsed += BenchNow() - start;
+	n += batch;
+    }
+    BenchReport (name, double(elapsed) / (n * nItems), unit);
+}
+
+/// Calls \p f until at least \p mintime ns elapse and reports the ns per call.
+template <typename F>
+inline void Bench (const char* name, F f, uint64_t mintime = 100000000)
+    { BenchItems (name, f, 1, "ns/op", mintime); }
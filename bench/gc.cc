@@ -0,0 +1,61 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "bench.h"
+#include "../gc.h"
+
+/// Measures the CGC drawing and diffing primitives on a screen-sized canvas.
+int main (void)
+{
+    CGC screen, gc;
+    screen.Resize (80, 24);
+    gc.Resize (80, 24);
+    const size_t nCells = gc.Canvas().size();
+    screen.Clear ('x');
+    gc.Clear ('x');
+    gc.Text (10, 10, "changed");
+
+    // MakeDiffFrom zeroes the unchanged cells, so the frame is restored for each diff
+    const CGC::canvas_t frame (gc.Canvas());
+    BenchItems ("gc/copy", [&]{ gc.Canvas() = frame; }, nCells, "ns/cell");
+    BenchItems ("gc/copy+diff", [&]{ gc.Canvas() = frame; gc.MakeDiffFrom (screen); }, nCells, "ns/cell");
+
+    // Listing the changed spans leaves the frame as it is
+    CGC::spans_t spans;
+    gc.Canvas() = frame;
+    BenchItems ("gc/diff/spans", [&]{ gc.MakeDiffFrom (screen, spans); }, nCells, "ns/cell");
+
+    // With the damage tracked, only the changed text is compared
+    gc.ClearDirty();
+    gc.MarkDirty (CGC::Rect (10, 10, 7, 1));
+    BenchItems ("gc/copy+diff/damage", [&]{ gc.Canvas() = frame; gc.MakeDiffFrom (screen); }, nCells, "ns/cell");
+
+    const string line ("The quick brown fox jumps over the lazy dog.\tAnd then some more text to fill the row");
+
+    // A redrawn log pane, where one row of text changed in the same format
+    for (auto l : { CGC::layout_Cells, CGC::layout_Planes }) {
+	const bool bPlanes = l == CGC::layout_Planes;
+	CGC shown, log;
+	for (CGC* g : { &shown, &log }) {
+	    g->SetLayout (l);
+	    g->Resize (80, 24);
+	    g->Clear();
+	    for (CGC::coord_t y = 0; y < g->Height(); ++y)
+		g->Text (0, y, line);
+	}
+	log.ClearDirty();
+	log.Clear();
+	for (CGC::coord_t y = 0; y < log.Height(); ++y)
+	    log.Text (0, y, line);
+	log.Text (4, 12, "slow");
+	BenchItems (bPlanes ? "gc/diff/log/planes" : "gc/diff/log", [&]{ log.MakeDiffFrom (shown, spans); }, nCells, "ns/cell");
+	BenchItems (bPlanes ? "gc/text/planes" : "gc/text/cells", [&]{ log.Text (0, 5, line); }, line.size(), "ns/char");
+    }
+
+    BenchItems ("gc/text", [&]{ gc.Text (0, 5, line); }, line.size(), "ns/char");
+    BenchItems ("gc/bar", [&]{ gc.Bar (0, 0, gc.Width(), gc.Height(), '.'); }, nCells, "ns/cell");
+    Bench ("gc/box", [&]{ gc.Box (10, 5, 40, 12); });
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,91 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "bench.h"
+#include "../gc.h"
+
+/// Draws a text screen with a title, \p h - 2 lines of a log starting at \p first, and a status line.
+static void DrawLog (CGC& gc, unsigned first, const char* status = "Ready")
+{
+    string line;
+    gc.Color (lightgray, black);
+    gc.Clear();
+    gc.Color (black, cyan);
+    gc.Bar (0, 0, gc.Width(), 1);
+    gc.Text (1, 0, "utio benchmark");
+    gc.Color (lightgray, black);
+    for (unsigned y = 1; y + 1u < gc.Height(); ++y) {
+	const unsigned n = first + y;
+	gc.FgColor (n % 7 ? lightgray : yellow);
+	line.format ("%6u  request %u handled in %u ms by worker %u", n, n * 7919 % 10007, n % 97, n % 8);
+	gc.Text (0, y, line);
+    }
+    gc.Color (white, blue);
+    gc.Bar (0, gc.Height() - 1, gc.Width(), 1);
+    gc.Text (1, gc.Height() - 1, status);
+}
+
+/// Reports the time and output size of drawing \p diff over \p shown, after \p scrolls.
+static void BenchImage (const CTerminfo& term, const char* name, const CGC& diff, const CGC* shown, const CGC::scrolls_t& scrolls = CGC::scrolls_t())
+{
+    size_t nBytes = 0;
+    auto draw = [&]{
+	nBytes = 0;
+	for (const auto& s : scrolls)
+	    nBytes += term.Scroll (s.top, s.bottom, s.n).size();
+	nBytes += term.Image (0, 0, diff.Width(), diff.Height(), diff.Canvas().begin(), shown ? shown->Canvas().begin() : nullptr, diff.Styles().begin()).size();
+    };
+    string fullName;
+    fullName.format ("image/%s", name);
+    BenchItems (fullName.c_str(), draw, 1, "ns/frame");
+    BenchReport (fullName.c_str(), nBytes, "bytes/frame");
+}
+
+/// Measures Image on typical frames: full repaints, small updates, scrolling, and many colors.
+int main (void)
+{
+    CTerminfo term;
+    term.Load();
+    CGC screen, gc;
+    screen.Resize (term.Width(), term.Height());
+    gc.Resize (term.Width(), term.Height());
+
+    // The whole screen drawn without knowing what was there
+    DrawLog (gc, 0);
+    BenchImage (term, "full", gc, nullptr);
+
+    // A status line update
+    DrawLog (screen, 0, "Ready 12:00:00");
+    DrawLog (gc, 0, "Ready 12:00:01");
+    CGC::spans_t spans;
+    gc.MakeDiffFrom (screen, spans);
+    size_t nBytes = 0;
+    BenchItems ("image/sparse/spans", [&]{ nBytes = term.Image (spans, gc.Width(), gc.Height(), gc.Canvas().begin(), screen.Canvas().begin(), gc.Styles().begin()).size(); }, 1, "ns/frame");
+    BenchReport ("image/sparse/spans", nBytes, "bytes/frame");
+    gc.MakeDiffFrom (screen);
+    BenchImage (term, "sparse", gc, &screen);
+
+    // A log scrolled by one line
+    CGC::scrolls_t scrolls;
+    DrawLog (screen, 0);
+    DrawLog (gc, 1);
+    if (term.CanScroll()) {
+	gc.FindScrolls (screen, scrolls);
+	for (const auto& s : scrolls)
+	    screen.Scroll (s.top, s.bottom, s.n);
+    }
+    gc.MakeDiffFrom (screen);
+    BenchImage (term, "scroll", gc, &screen, scrolls);
+
+    // Every cell in a different color
+    for (CGC::dim_t y = 0; y < gc.Height(); ++y) {
+	for (CGC::dim_t x = 0; x < gc.Width(); ++x) {
+	    gc.Style (IndexedColor ((x + y) % 256), IndexedColor ((x * y + 16) % 256));
+	    gc.Char (x, y, 'a' + (x + y) % 26);
+	}
+    }
+    BenchImage (term, "color", gc, nullptr);
+    return EXIT_SUCCESS;
+}
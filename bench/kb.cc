@@ -0,0 +1,53 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "bench.h"
+#include "../kb.h"
+
+/// Decodes all keys in \p data and returns their number.
+static size_t DecodeAll (CKeyboard& kb, const string& data)
+{
+    istream is (data.data(), data.size());
+    size_t n = 0;
+    while (kb.DecodeKey (is))
+	++n;
+    return n;
+}
+
+/// Reports the per-key cost of decoding \p data.
+static void BenchDecode (CKeyboard& kb, const char* name, const string& data)
+{
+    const size_t nKeys = DecodeAll (kb, data);
+    BenchItems (name, [&]{ DecodeAll (kb, data); }, nKeys, "ns/key");
+}
+
+/// Measures CKeyboard::DecodeKey on typed keys and on pasted text.
+int main (void)
+{
+    CTerminfo term;
+    term.Load();
+    CKeyboard kb;
+    kb.LoadKeymap (term);
+
+    // Navigation and editing as sent by the terminal, mixed with typing
+    string keys;
+    static const ti::EStrings c_Keys[] = {
+	ti::key_up, ti::key_down, ti::key_left, ti::key_right, ti::key_home, ti::key_end,
+	ti::key_ppage, ti::key_npage, ti::key_dc, ti::key_f1, ti::key_f5, ti::key_f12
+    };
+    for (unsigned i = 0; i < 8; ++i) {
+	for (auto k : c_Keys)
+	    keys += term.GetString (k);
+	keys += "ls -l\r\033x\x7f";
+    }
+    BenchDecode (kb, "kb/keys", keys);
+
+    // A pasted paragraph, with some UTF-8
+    string paste;
+    for (unsigned i = 0; i < 8; ++i)
+	paste += "Lorem ipsum dolor sit amet, consectetur adipiscing elit; na\xc3\xafve caf\xc3\xa9 \xe2\x86\x92 r\xc3\xa9sum\xc3\xa9.\n";
+    BenchDecode (kb, "kb/paste", paste);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,29 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "bench.h"
+
+/// Measures loading the terminfo entry from each of the supported sources.
+int main (void)
+{
+    static const struct {
+	const char*	name;
+	unsigned	flags;
+    } c_Sources[] = {
+	{ "load/read",		0 },
+	{ "load/map",		CTerminfo::load_Map },
+	{ "load/cache",		CTerminfo::load_Cache }
+    };
+    CTerminfo term;
+    for (const auto& s : c_Sources)
+	Bench (s.name, [&]{ term.Load (nullptr, s.flags); });
+    Bench ("load/new", []{ CTerminfo t; t.Load (nullptr, CTerminfo::load_Map); });	// Including the search path listing
+    // A local terminfo database would be searched before the built-in entry
+    unsetenv ("TERMINFO");
+    unsetenv ("TERMINFO_DIRS");
+    unsetenv ("HOME");
+    Bench ("load/builtin", [&]{ term.Load (nullptr, CTerminfo::load_Builtin); });
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,37 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "bench.h"
+
+/// Compares the string cap interpreter with the precompiled programs.
+int main (void)
+{
+    CTerminfo term;
+    term.Load();
+    static const struct {
+	const char*			name;
+	ti::EStrings			cap;
+	CTerminfo::progargs_t		args;
+    } c_Caps[] = {
+	{ "cup",	ti::cursor_address,	CTerminfo::progargs_t (23, 79) },
+	{ "setaf",	ti::set_a_foreground,	CTerminfo::progargs_t (lightcyan) },
+	{ "setab",	ti::set_a_background,	CTerminfo::progargs_t (brown) },
+	{ "sgr",	ti::set_attributes,	CTerminfo::progargs_t (1, 0, 0, 1) },
+	{ "hpa",	ti::column_address,	CTerminfo::progargs_t (40) },
+	{ "cuf",	ti::parm_right_cursor,	CTerminfo::progargs_t (12) },
+	{ "ech",	ti::erase_chars,	CTerminfo::progargs_t (20) },
+	{ "rep",	ti::repeat_char,	CTerminfo::progargs_t ('-', 30) },
+	{ "csr",	ti::change_scroll_region,	CTerminfo::progargs_t (2, 21) }
+    };
+    string out, name;
+    out.reserve (256);
+    for (const auto& c : c_Caps) {
+	name.format ("tiprog/interp/%s", c.name);
+	Bench (name.c_str(), [&]{ out.clear(); term.RunStringProgram (term.GetString (c.cap), out, c.args); });
+	name.format ("tiprog/compiled/%s", c.name);
+	Bench (name.c_str(), [&]{ out.clear(); term.RunProgram (c.cap, out, c.args); });
+    }
+    return EXIT_SUCCESS;
+}
@@ -5,25 +5,120 @@
 
 #include "gc.h"
 #include "ti.h"
+#if __SSE2__
+    #include <emmintrin.h>
+#endif
+#if __AVX2__
+    #include <immintrin.h>
+#endif
 
 namespace utio {
 
 //----------------------------------------------------------------------
 
+/// Style table size below which unused styles are kept. See CompactStyles.
+static const uint32_t c_MinStyleLimit = 4096;
+
+/// The stamp of the last style added to any table. See ShareStyles.
+static uint64_t s_LastStyleStamp = 0;
+
 CGC::CGC (void)
 :_canvas()
+,_chars()
+,_formats()
+,_styles()
+,_styleStamps()
+,_styleIndex()
+,_styleLimit (c_MinStyleLimit)
+,_dirty()
+,_formatsDirty()
+,_rowHashes()
 ,_template()
 ,_size (0, 0)
 ,_tabSize (8)
+,_layout (layout_Cells)
+{
+}
+
+/// Copies \p v. A style table extending this one is copied by appending the new styles.
+CGC& CGC::operator= (const CGC& v)
 {
+    if (&v == this)
+	return *this;
+    _canvas = v._canvas;
+    _chars = v._chars;
+    _formats = v._formats;
+    if (!ShareStyles (v) || _styles.size() != v._styles.size()) {
+	_styles = v._styles;
+	_styleStamps = v._styleStamps;
+	_styleIndex = v._styleIndex;
+    }
+    _styleLimit = v._styleLimit;
+    _dirty = v._dirty;
+    _formatsDirty = v._formatsDirty;
+    _rowHashes = v._rowHashes;
+    _template = v._template;
+    _size = v._size;
+    _tabSize = v._tabSize;
+    _layout = v._layout;
+    return *this;
 }
 
 void CGC::Resize (Size2d sz)
 {
     fill (_size, 0);
     _canvas.clear();
-    _canvas.resize (sz[0] * sz[1]);
+    _chars.clear();
+    _formats.clear();
+    if (_layout == layout_Cells)
+	_canvas.resize (sz[0] * sz[1]);
+    else {
+	_chars.resize (sz[0] * sz[1]);
+	_formats.resize (sz[0] * sz[1]);
+	fill (_chars, L' ');
+	fill (_formats, CCharCell().Format());
+    }
     _size = sz;
+    _dirty.resize (sz[1]);
+    _formatsDirty.resize (sz[1]);
+    _rowHashes.resize (sz[1]);
+    MarkDirty();
+}
+
+/// Stores the cells as whole cells, or as separate planes of characters and formats.
+///
+/// Planes suit canvasses where mostly the characters change, like logs
+/// in a uniform format. Drawing writes a format only where it differs,
+/// and rows where none did have only their characters compared by
+/// MakeDiffFrom. Canvas() is not available with layout_Planes; cells
+/// are read with GetCell, or through Chars() and Formats(). The cells
+/// are kept, and Present converts the screen cache to the layout of
+/// the frame.
+///
+void CGC::SetLayout (ELayout l)
+{
+    if (l == _layout)
+	return;
+    const size_t n = Width() * Height();
+    if (l == layout_Planes) {
+	_chars.resize (n);
+	_formats.resize (n);
+	for (size_t i = 0; i < n; ++i) {
+	    _chars[i] = _canvas[i].c;
+	    _formats[i] = _canvas[i].Format();
+	}
+	_canvas.clear();
+    } else {
+	_canvas.resize (n);
+	for (size_t i = 0; i < n; ++i) {
+	    _canvas[i].c = _chars[i];
+	    _canvas[i].SetFormat (_formats[i]);
+	}
+	_chars.clear();
+	_formats.clear();
+    }
+    _layout = l;
+    MarkDirty();
 }
 
 inline CGC::canvas_t::iterator CGC::CanvasAt (Point2d p)
@@ -36,11 +131,49 @@ inline CGC::canvas_t::const_iterator CGC::CanvasAt (Point2d p) const
     return _canvas.begin() + p[1] * _size[0] + p[0];
 }
 
+/// Sets \p n cells from \p p, on one row, to \p v.
+void CGC::SetCells (Point2d p, dim_t n, const CCharCell& v)
+{
+    if (_layout == layout_Cells)
+	fill_n (CanvasAt (p), n, v);
+    else {
+	fill_n (_chars.begin() + CellIndex (p), n, v.c);
+	SetFormats (CellIndex (p), n, v.Format());
+    }
+}
+
+/// Sets formats [\p i, \p i + \p n), on one row, to \p f, marking the row if any changed.
+void CGC::SetFormats (size_t i, dim_t n, uint32_t f)
+{
+    bool bChanged = false;
+    for (auto fi = _formats.begin() + i, fe = fi + n; fi < fe; ++fi) {
+	bChanged |= *fi != f;
+	*fi = f;
+    }
+    if (bChanged)
+	_formatsDirty[i / Width()] = true;
+}
+
 /// Clears the canvas with spaces with current attributes.
 void CGC::Clear (wchar_t c)
 {
     const CCharCell vlc (c, _template);
-    fill (_canvas, vlc);
+    if (_layout == layout_Cells)
+	fill (_canvas, vlc);
+    else {
+	for (coord_t y = 0; y < Height(); ++y)
+	    SetCells (Point2d (0, y), Width(), vlc);
+    }
+    MarkSpans (Rect (0, 0, Width(), Height()));
+}
+
+/// Sets all cells to \p v, regardless of the drawing values.
+void CGC::Fill (const CCharCell& v)
+{
+    fill (_canvas, v);
+    fill (_chars, v.c);
+    fill (_formats, v.Format());
+    MarkDirty();
 }
 
 /// Draws a line art box.
@@ -49,6 +182,7 @@ void CGC::Box (Rect r)
     Clip (r);
     if ((r.Width() < 2) | (r.Height() < 2))
 	return;
+    MarkSpans (r);
     r[1] -= 1;
     Point2d trCorner (r[1][0], r[0][1]);
     Point2d blCorner (r[0][0], r[1][1]);
@@ -57,10 +191,10 @@ void CGC::Box (Rect r)
     HLine (rr[1], r.Width());
     VLine (r[0], r.Height());
     VLine (rr[0], r.Height());
-    *CanvasAt(rr[0]) = CCharCell (acsv_UpperRightCorner, _template);
-    *CanvasAt(rr[1]) = CCharCell (acsv_LowerLeftCorner, _template);
-    *CanvasAt(r[1]) = CCharCell (acsv_LowerRightCorner, _template);
-    *CanvasAt(r[0]) = CCharCell (acsv_UpperLeftCorner, _template);
+    SetCell (rr[0], CCharCell (acsv_UpperRightCorner, _template));
+    SetCell (rr[1], CCharCell (acsv_LowerLeftCorner, _template));
+    SetCell (r[1], CCharCell (acsv_LowerRightCorner, _template));
+    SetCell (r[0], CCharCell (acsv_UpperLeftCorner, _template));
 }
 
 /// Draws a box with character \p c as the border.
@@ -69,7 +203,8 @@ void CGC::Bar (Rect r, wchar_t c)
     Clip (r);
     const CCharCell vlc (c, _template);
     for (dim_t y = 0; y < r.Height(); ++ y)
-	fill_n (CanvasAt (Point2d (r[0][0], r[0][1] + y)), r.Width(), vlc);
+	SetCells (Point2d (r[0][0], r[0][1] + y), r.Width(), vlc);
+    MarkSpans (r);
 }
 
 /// Draws a horizontal line from \p p of length \p l.
@@ -79,7 +214,8 @@ void CGC::HLine (Point2d p, dim_t l)
 	return;
     if (coord_t(l) > _size[0] - p[0])
 	l = _size[0] - p[0];
-    fill_n (CanvasAt(p), l, CCharCell (acsv_HLine, _template));
+    SetCells (p, l, CCharCell (acsv_HLine, _template));
+    MarkSpans (Rect (p[0], p[1], l, 1));
 }
 
 /// Draws a vertical line from \p p of length \p l.
@@ -91,7 +227,8 @@ void CGC::VLine (Point2d p, dim_t l)
 	l = _size[1] - p[1];
     const CCharCell vlc (acsv_VLine, _template);
     for (dim_t i = 0; i < l; ++i)
-	*CanvasAt (Point2d (p[0], p[1] + i)) = vlc;
+	SetCell (Point2d (p[0], p[1] + i), vlc);
+    MarkSpans (Rect (p[0], p[1], 1, l));
 }
 
 /// Copies canvas data from \p r into \p cells.
@@ -101,6 +238,15 @@ void CGC::GetImage (Rect r, canvas_t& cells) const
     Clip (r);
     cells.resize (r.Width() * r.Height());
     auto dout (cells.begin());
+    if (_layout == layout_Planes) {
+	for (auto y = 0u; y < r.Height(); ++y)
+	    for (auto x = 0u; x < r.Width(); ++x, ++dout) {
+		const auto v (GetCell (Point2d (r[0][0] + x, r[0][1] + y)));
+		if (v.c)
+		    *dout = v;
+	    }
+	return;
+    }
     auto din (CanvasAt (r[0]));
     for (auto y = 0u; y < r.Height(); ++y, din += inyskip)
 	for (auto x = 0u; x < r.Width(); ++x, ++din, ++dout)
@@ -114,36 +260,477 @@ void CGC::Image (Rect r, const canvas_t& cells)
     const auto outyskip = Width() - r.Width();
     Clip (r);
     auto din (cells.begin());
+    if (_layout == layout_Planes) {
+	for (auto y = 0u; y < r.Height(); ++ y)
+	    for (auto x = 0u; x < r.Width(); ++ x, ++ din)
+		if (din->c)
+		    SetCell (Point2d (r[0][0] + x, r[0][1] + y), *din);
+	MarkSpans (r);
+	return;
+    }
     auto dout (CanvasAt (r[0]));
     for (auto y = 0u; y < r.Height(); ++ y, dout += outyskip)
 	for (auto x = 0u; x < r.Width(); ++ x, ++ din, ++ dout)
 	    if (din->c)
 		*dout = *din;
+    MarkSpans (r);
+}
+
+/// Copies \p cells, in either layout, to the top left corner.
+void CGC::Image (const CGC& cells)
+{
+    const bool bSharedStyles = ShareStyles (cells);
+    if (bSharedStyles && cells.Layout() == layout_Cells) {
+	Image (Rect (0, 0, cells.Width(), cells.Height()), cells.Canvas());
+	return;
+    }
+    Rect r (0, 0, cells.Width(), cells.Height());
+    Clip (r);
+    for (coord_t y = 0; y < r[1][1]; ++y) {
+	for (coord_t x = 0; x < r[1][0]; ++x) {
+	    auto v (cells.GetCell (Point2d (x, y)));
+	    if (!v.c)
+		continue;
+	    if (!bSharedStyles)
+		ImportStyle (cells, v);
+	    SetCell (Point2d (x, y), v);
+	}
+    }
+    MarkSpans (r);
+}
+
+/// Copies the cells in \p spans from the equally sized \p cells of the same layout.
+void CGC::Image (const CGC& cells, const spans_t& spans)
+{
+    assert (cells.Size() == Size() && cells.Layout() == Layout() && "Spans can only be copied between equally sized canvasses of the same layout");
+    const bool bSharedStyles = ShareStyles (cells);
+    for (const auto& s : spans) {
+	const auto i = CellIndex (Point2d (s.first, s.y)), iend = i + (s.last - s.first);
+	if (!bSharedStyles) {
+	    for (auto x = s.first; x < s.last; ++x) {
+		auto v (cells.GetCell (Point2d (x, s.y)));
+		if (!v.c)
+		    continue;
+		ImportStyle (cells, v);
+		SetCell (Point2d (x, s.y), v);
+	    }
+	} else if (_layout == layout_Planes) {
+	    bool bFormats = false;
+	    for (auto j = i; j < iend; ++j) {
+		if (!cells._chars[j])
+		    continue;
+		_chars[j] = cells._chars[j];
+		bFormats |= _formats[j] != cells._formats[j];
+		_formats[j] = cells._formats[j];
+	    }
+	    _formatsDirty[s.y] = _formatsDirty[s.y] || bFormats;
+	} else {
+	    for (auto j = i; j < iend; ++j)
+		if (cells._canvas[j].c)
+		    _canvas[j] = cells._canvas[j];
+	}
+	MarkSpans (Rect (s.first, s.y, s.last - s.first, 1));
+    }
+}
+
+/// Copies the cells in \p r of \p cells, in either layout, to \p p.
+/// Cells with a 0 character are skipped, leaving what is under them.
+void CGC::Image (Point2d p, const CGC& cells, Rect r)
+{
+    const bool bSharedStyles = ShareStyles (cells);
+    // Both rectangles are clipped, each moving the other by what it lost
+    const Point2d sfrom (r[0]);
+    cells.Clip (r);
+    Rect d (p[0] + r[0][0] - sfrom[0], p[1] + r[0][1] - sfrom[1], r.Width(), r.Height());
+    const Point2d dfrom (d[0]);
+    Clip (d);
+    const coord_t sx = r[0][0] + d[0][0] - dfrom[0], sy = r[0][1] + d[0][1] - dfrom[1];
+    for (coord_t y = 0; y < coord_t(d.Height()); ++y) {
+	if (bSharedStyles && _layout == layout_Cells && cells._layout == layout_Cells) {
+	    auto din (cells.CanvasAt (Point2d (sx, sy + y)));
+	    auto dout (CanvasAt (Point2d (d[0][0], d[0][1] + y)));
+	    for (auto x = 0u; x < d.Width(); ++x, ++din, ++dout)
+		if (din->c)
+		    *dout = *din;
+	} else {
+	    for (coord_t x = 0; x < coord_t(d.Width()); ++x) {
+		auto v (cells.GetCell (Point2d (sx + x, sy + y)));
+		if (!v.c)
+		    continue;
+		if (!bSharedStyles)
+		    ImportStyle (cells, v);
+		SetCell (Point2d (d[0][0] + x, d[0][1] + y), v);
+	    }
+	}
+    }
+    MarkSpans (d);
+}
+
+/// Returns the number of leading cells of \p a, up to \p n, that equal those of \p b if \p bEqual, or differ if not.
+///
+/// Cells are compared whole, as 64-bit values, four at a time with AVX2
+/// and two at a time with SSE2.
+///
+static size_t CellRun (const CCharCell* a, const CCharCell* b, size_t n, bool bEqual)
+{
+    static_assert (sizeof(CCharCell) == sizeof(uint64_t), "Cells are compared as 64-bit values");
+    size_t i = 0;
+#if __AVX2__
+    const int want4 = bEqual ? 0xf : 0;
+    for (; i + 4 <= n; i += 4) {
+	const __m256i eq = _mm256_cmpeq_epi64 (_mm256_loadu_si256 (reinterpret_cast<const __m256i*>(a + i)), _mm256_loadu_si256 (reinterpret_cast<const __m256i*>(b + i)));
+	const int m = _mm256_movemask_pd (_mm256_castsi256_pd (eq));
+	if (m != want4)
+	    return i + __builtin_ctz (m ^ want4);
+    }
+#endif
+#if __SSE2__
+    const int want2 = bEqual ? 3 : 0;
+    for (; i + 2 <= n; i += 2) {
+	const int m = _mm_movemask_ps (_mm_castsi128_ps (_mm_cmpeq_epi32 (_mm_loadu_si128 (reinterpret_cast<const __m128i*>(a + i)), _mm_loadu_si128 (reinterpret_cast<const __m128i*>(b + i)))));
+	const int eq = ((m & 3) == 3) | (((m & 0xc) == 0xc) << 1);	// A cell is equal if both halves are
+	if (eq != want2)
+	    return i + __builtin_ctz (eq ^ want2);
+    }
+#endif
+    for (uint64_t va, vb; i < n; ++i) {
+	memcpy (&va, a + i, sizeof(va));
+	memcpy (&vb, b + i, sizeof(vb));
+	if ((va == vb) != bEqual)
+	    break;
+    }
+    return i;
+}
+
+/// Returns the number of leading cells, up to \p n, with characters \p a and formats \p af that equal those of \p b and \p bf if \p bEqual, or differ if not.
+///
+/// Without \p af, only the characters are compared. The planes are
+/// compared eight cells at a time with AVX2 and four at a time with SSE2.
+///
+static size_t PlaneRun (const wchar_t* a, const wchar_t* b, const uint32_t* af, const uint32_t* bf, size_t n, bool bEqual)
+{
+    static_assert (sizeof(wchar_t) == sizeof(uint32_t), "Character planes are compared as 32-bit values");
+    size_t i = 0;
+#if __AVX2__
+    const int want8 = bEqual ? 0xff : 0;
+    for (; i + 8 <= n; i += 8) {
+	__m256i eq = _mm256_cmpeq_epi32 (_mm256_loadu_si256 (reinterpret_cast<const __m256i*>(a + i)), _mm256_loadu_si256 (reinterpret_cast<const __m256i*>(b + i)));
+	if (af)
+	    eq = _mm256_and_si256 (eq, _mm256_cmpeq_epi32 (_mm256_loadu_si256 (reinterpret_cast<const __m256i*>(af + i)), _mm256_loadu_si256 (reinterpret_cast<const __m256i*>(bf + i))));
+	const int m = _mm256_movemask_ps (_mm256_castsi256_ps (eq));
+	if (m != want8)
+	    return i + __builtin_ctz (m ^ want8);
+    }
+#endif
+#if __SSE2__
+    const int want4 = bEqual ? 0xf : 0;
+    for (; i + 4 <= n; i += 4) {
+	__m128i eq = _mm_cmpeq_epi32 (_mm_loadu_si128 (reinterpret_cast<const __m128i*>(a + i)), _mm_loadu_si128 (reinterpret_cast<const __m128i*>(b + i)));
+	if (af)
+	    eq = _mm_and_si128 (eq, _mm_cmpeq_epi32 (_mm_loadu_si128 (reinterpret_cast<const __m128i*>(af + i)), _mm_loadu_si128 (reinterpret_cast<const __m128i*>(bf + i))));
+	const int m = _mm_movemask_ps (_mm_castsi128_ps (eq));
+	if (m != want4)
+	    return i + __builtin_ctz (m ^ want4);
+    }
+#endif
+    for (; i < n; ++i)
+	if ((a[i] == b[i] && (!af || af[i] == bf[i])) != bEqual)
+	    break;
+    return i;
 }
 
 /// Zeroes out cells which are identical to those in \p src.
+///
+/// Only the dirty spans of each row are compared. Cells outside them are
+/// taken to be unchanged since \p src was drawn, and are zeroed without
+/// looking. A canvas that is never cleared with ClearDirty is all dirty,
+/// and is compared in full. With layout_Planes, only the characters of
+/// the unchanged cells are zeroed.
+///
 bool CGC::MakeDiffFrom (const CGC& src)
 {
-    assert (src.Canvas().size() == _canvas.size() && "Diffs can only be made on equally sized canvasses");
-    auto inew (Canvas().begin());
-    auto iold (src.Canvas().begin());
-    const auto iend (src.Canvas().end());
+    assert (src.Size() == Size() && src.Layout() == Layout() && "Diffs can only be made on equally sized canvasses of the same layout");
+    if (_layout == layout_Planes) {
+	spans_t spans;
+	MakeDiffFrom (src, spans);
+	size_t i = 0;
+	for (const auto& s : spans) {
+	    fill (_chars.begin() + i, _chars.begin() + CellIndex (Point2d (s.first, s.y)), 0);
+	    i = CellIndex (Point2d (s.last, s.y));
+	}
+	fill (_chars.begin() + i, _chars.end(), 0);
+	return !spans.empty();
+    }
     const CCharCell nullCell (0, color_Preserve, color_Preserve, 0);
     bool bHaveChanges = false;
-    for (; iold < iend; ++iold, ++inew) {
-	const bool bSameCell (*iold == *inew);
-	if (bSameCell)
-	    *inew = nullCell;
-	bHaveChanges |= !bSameCell;
+    for (coord_t y = 0; y < Height(); ++y) {
+	const auto row (CanvasAt (Point2d (0, y)));
+	const auto srow (src.CanvasAt (Point2d (0, y)));
+	const auto& d = _dirty[y];
+	fill (row, row + (d.Empty() ? Width() : d.first), nullCell);
+	if (d.Empty())
+	    continue;
+	fill (row + d.last, row + Width(), nullCell);
+	for (coord_t x = d.first; x < d.last;) {
+	    const coord_t same = CellRun (row + x, srow + x, d.last - x, true);
+	    fill_n (row + x, same, nullCell);
+	    x += same;
+	    if (x < d.last) {
+		x += CellRun (row + x, srow + x, d.last - x, false);
+		bHaveChanges = true;
+	    }
+	}
     }
     return bHaveChanges;
 }
 
+/// Lists in \p spans the cells that differ from those in \p src. Returns true if there are any.
+///
+/// Unlike the other MakeDiffFrom, neither canvas is changed. The spans
+/// can be drawn with the CTerminfo::Image overload taking them. As there,
+/// only the dirty spans of each row are compared. With layout_Planes, the
+/// formats are compared only on rows where drawing changed them, so rows
+/// of changed text in an unchanged format are compared at half the cost.
+///
+bool CGC::MakeDiffFrom (const CGC& src, spans_t& spans) const
+{
+    assert (src.Size() == Size() && src.Layout() == Layout() && "Diffs can only be made on equally sized canvasses of the same layout");
+    spans.clear();
+    for (coord_t y = 0; y < Height(); ++y) {
+	const auto& d = _dirty[y];
+	const auto row = CellIndex (Point2d (0, y));
+	const bool bFormats = _formatsDirty[y];
+	auto run = [&](coord_t x, bool bEqual) -> coord_t {
+	    if (_layout == layout_Cells)
+		return CellRun (&_canvas[row + x], &src._canvas[row + x], d.last - x, bEqual);
+	    return PlaneRun (&_chars[row + x], &src._chars[row + x], bFormats ? &_formats[row + x] : nullptr, &src._formats[row + x], d.last - x, bEqual);
+	};
+	for (coord_t x = d.first; x < d.last;) {
+	    x += run (x, true);
+	    if (x >= d.last)
+		break;
+	    const coord_t changed = run (x, false);
+	    spans.push_back (Span { y, x, coord_t(x + changed) });
+	    x += changed;
+	}
+    }
+    return !spans.empty();
+}
+
+/// Returns a hash of the \p w cells in \p row. It is never 0.
+uint32_t CGC::RowHash (const CCharCell* row, dim_t w)
+{
+    const uint32_t c_FnvPrime = 0x01000193;
+    uint32_t h = 0x811c9dc5;
+    for (const auto rowEnd = row + w; row < rowEnd; ++row) {
+	h = (h ^ row->c) * c_FnvPrime;
+	h = (h ^ row->Format()) * c_FnvPrime;
+    }
+    return h ? h : 1;
+}
+
+/// Returns the hash of row \p y, the same in either layout.
+///
+/// The hash is kept in _rowHashes until the row is marked changed, so
+/// that only changed rows are hashed again.
+///
+uint32_t CGC::RowHash (coord_t y) const
+{
+    auto& h = _rowHashes[y];
+    if (h)
+	return h;
+    const auto i = CellIndex (Point2d (0, y));
+    if (_layout == layout_Cells)
+	return h = RowHash (&_canvas[i], Width());
+    const uint32_t c_FnvPrime = 0x01000193;
+    uint32_t v = 0x811c9dc5;
+    for (auto j = i; j < i + Width(); ++j) {
+	v = (v ^ _chars[j]) * c_FnvPrime;
+	v = (v ^ _formats[j]) * c_FnvPrime;
+    }
+    return h = v ? v : 1;
+}
+
+/// The cell a terminal shows in rows scrolled in, which CTerminfo::Scroll erases in lightgray on black.
+static const CCharCell c_ScrolledBlank (' ', lightgray, black);
+
+/// Moves \p h rows of \p rowSize elements at \p first up by \p n rows, or down if negative.
+template <typename T>
+static void ScrollRows (T* first, size_t rowSize, CGC::dim_t h, CGC::coord_t n, const T& blank)
+{
+    const size_t total = h * rowSize, shift = min (CGC::dim_t(absv (n)), h) * rowSize;
+    if (n > 0) {
+	copy (first + shift, first + total, first);
+	fill_n (first + total - shift, shift, blank);
+    } else if (n < 0) {
+	copy_backward (first, first + total - shift, first + total);
+	fill_n (first, shift, blank);
+    }
+}
+
+/// Returns the number of rows in \p s matching \p nh after it is applied to \p oh, less those before.
+static int ScrollGain (const uint32_t* oh, const uint32_t* nh, const CGC::SScroll& s, uint32_t blank)
+{
+    int gain = 0;
+    for (auto r = s.top; r < s.bottom; ++r) {
+	const auto src = r + s.n;
+	gain += (nh[r] == (src >= s.top && src < s.bottom ? oh[src] : blank)) - (nh[r] == oh[r]);
+    }
+    return gain;
+}
+
+/// Finds the scrolls that move rows of \p from to where they are in this canvas.
+///
+/// Rows are compared by hash, kept by each canvas for its unchanged rows,
+/// so only changed rows are hashed. Scrolls are only looked for when
+/// c_MinScrollRows or more rows differ, since a scroll costs about as
+/// much output as redrawing a few rows. Each candidate is anchored on a
+/// changed row whose contents occur once in both canvasses, and extends
+/// over adjacent rows matching at the same shift. The candidate whose region gains the
+/// most matching rows is taken and applied to \p from's hashes, and the
+/// search repeats until no candidate gains a row.
+///
+/// The scrolls must be applied in order, both to the terminal with
+/// CTerminfo::Scroll and to the screen cache with Scroll, before the diff.
+///
+void CGC::FindScrolls (const CGC& from, scrolls_t& scrolls) const
+{
+    scrolls.clear();
+    if (from.Size() != Size() || !Width())
+	return;
+    const coord_t h = Height();
+    vector<uint32_t> oh (h), nh (h);
+    coord_t nChanged = 0;
+    for (coord_t y = 0; y < h; ++y) {
+	oh[y] = from.RowHash (y);
+	nh[y] = RowHash (y);
+	nChanged += oh[y] != nh[y];
+    }
+    const coord_t c_MinScrollRows = 3;
+    if (nChanged < c_MinScrollRows)
+	return;
+    const canvas_t blankRow (Width(), c_ScrolledBlank);
+    const uint32_t blank = RowHash (blankRow.begin(), Width());
+    for (;;) {
+	SScroll best = { 0, 0, 0 };
+	int bestGain = 0;
+	for (coord_t i = 0; i < h; ++i) {
+	    if (nh[i] == oh[i])
+		continue;
+	    coord_t j = 0;
+	    unsigned nOld = 0, nNew = 0;
+	    for (coord_t k = 0; k < h; ++k) {
+		if (oh[k] == nh[i]) {
+		    j = k;
+		    ++nOld;
+		}
+		nNew += nh[k] == nh[i];
+	    }
+	    if (nOld != 1 || nNew != 1)
+		continue;
+	    const coord_t d = j - i;
+	    coord_t i0 = i, i1 = i + 1;
+	    while (i0 > 0 && i0 - 1 + d >= 0 && nh[i0 - 1] == oh[i0 - 1 + d])
+		--i0;
+	    while (i1 < h && i1 + d < h && nh[i1] == oh[i1 + d])
+		++i1;
+	    const SScroll s = { min (i0, coord_t(i0 + d)), max (i1, coord_t(i1 + d)), d };
+	    const int gain = ScrollGain (oh.begin(), nh.begin(), s, blank);
+	    if (gain > bestGain) {
+		best = s;
+		bestGain = gain;
+	    }
+	}
+	if (!bestGain)
+	    break;
+	ScrollRows (oh.begin() + best.top, 1, best.bottom - best.top, best.n, blank);
+	scrolls.push_back (best);
+    }
+}
+
+/// Moves rows [\p top, \p bottom) up by \p n rows, or down if negative, as a terminal scroll region would.
+void CGC::Scroll (coord_t top, coord_t bottom, coord_t n)
+{
+    assert (top >= 0 && top <= bottom && bottom <= Height() && "Scroll region must be on the canvas");
+    if (_layout == layout_Cells)
+	ScrollRows (CanvasAt (Point2d (0, top)), Width(), bottom - top, n, c_ScrolledBlank);
+    else {
+	ScrollRows (&_chars [CellIndex (Point2d (0, top))], Width(), bottom - top, n, c_ScrolledBlank.c);
+	ScrollRows (&_formats [CellIndex (Point2d (0, top))], Width(), bottom - top, n, c_ScrolledBlank.Format());
+    }
+    MarkDirty (Rect (0, top, Width(), bottom - top));
+}
+
+/// Marks the cells in \p r as changed.
+///
+/// Drawing functions mark the cells they draw. Cells written directly
+/// through Canvas(), Chars() or Formats() must be marked with this.
+///
+void CGC::MarkDirty (Rect r)
+{
+    Clip (r);
+    MarkSpans (r);
+    for (coord_t y = r[0][1]; y < r[1][1]; ++y)
+	_formatsDirty[y] = true;
+}
+
+/// Marks the cells in clipped \p r as changed, leaving formats to SetFormats.
+void CGC::MarkSpans (Rect r)
+{
+    if (r.Empty())
+	return;
+    for (coord_t y = r[0][1]; y < r[1][1]; ++y) {
+	_rowHashes[y] = 0;
+	auto& d = _dirty[y];
+	if (d.Empty())
+	    d = SDirtySpan { r[0][0], r[1][0] };
+	else {
+	    d.first = min (d.first, r[0][0]);
+	    d.last = max (d.last, r[1][0]);
+	}
+    }
+}
+
+/// Marks the whole canvas as changed.
+void CGC::MarkDirty (void)
+{
+    fill (_dirty, SDirtySpan { 0, coord_t(Width()) });
+    fill (_formatsDirty, true);
+    fill (_rowHashes, 0);
+}
+
+/// Marks the spans in damage \p d, from Damage of an equally sized canvas, as changed.
+void CGC::MarkDirty (const damage_t& d)
+{
+    assert (d.size() == _dirty.size() && "Damage can only be merged from an equally sized canvas");
+    for (coord_t y = 0; y < Height(); ++y)
+	if (!d[y].Empty())
+	    MarkDirty (Rect (d[y].first, y, d[y].last - d[y].first, 1));
+}
+
+/// Marks the whole canvas as unchanged, typically after it is presented.
+void CGC::ClearDirty (void)
+{
+    fill (_dirty, SDirtySpan { 0, 0 });
+    fill (_formatsDirty, false);
+}
+
+/// Returns true if any cell was changed since ClearDirty.
+bool CGC::Dirty (void) const
+{
+    for (const auto& d : _dirty)
+	if (!d.Empty())
+	    return true;
+    return false;
+}
+
 /// Prints character \p c.
 void CGC::Char (Point2d p, wchar_t c)
 {
-    if (Clip (p))
-	*CanvasAt(p) = CCharCell (c, _template);
+    if (!Clip (p))
+	return;
+    SetCell (p, CCharCell (c, _template));
+    MarkSpans (Rect (p[0], p[1], 1, 1));
 }
 
 /// Prints string \p str at \p p.
@@ -151,19 +738,281 @@ void CGC::Text (Point2d p, const string& str)
 {
     if (!Clip (p))
 	return;
-    auto doutstart (CanvasAt (p));
-    auto doutend = doutstart + (_size[0] - p[0]);
-    assert (doutend >= doutstart);
-    auto dout (doutstart);
-    for (auto si = str.utf8_begin(); si < str.utf8_end() && dout < doutend; ++si) {
-	if (*si == '\t') {
-	    const size_t absX = p[0] + distance (doutstart, dout);
-	    size_t toTab = Align (absX + 1, _tabSize) - absX;
-	    toTab = min (toTab, size_t(distance (dout, doutend)));
-	    dout = fill_n (dout, toTab, CCharCell (' ', _template));
-	} else
-	    *dout++ = CCharCell (*si, _template);
+    // Writes the text from doutstart, as cells made by cell, returning their number
+    auto expand = [&](auto doutstart, auto cell) {
+	auto doutend = doutstart + (_size[0] - p[0]);
+	assert (doutend >= doutstart);
+	auto dout (doutstart);
+	for (auto si = str.utf8_begin(); si < str.utf8_end() && dout < doutend; ++si) {
+	    if (*si == '\t') {
+		const size_t absX = p[0] + distance (doutstart, dout);
+		size_t toTab = Align (absX + 1, _tabSize) - absX;
+		toTab = min (toTab, size_t(distance (dout, doutend)));
+		dout = fill_n (dout, toTab, cell (' '));
+	    } else
+		*dout++ = cell (*si);
+	}
+	return dim_t (distance (doutstart, dout));
+    };
+    dim_t n;
+    if (_layout == layout_Cells)
+	n = expand (CanvasAt (p), [this](wchar_t c) { return CCharCell (c, _template); });
+    else {	// The characters are written alone, with the format set once
+	n = expand (_chars.begin() + CellIndex (p), [](wchar_t c) { return c; });
+	SetFormats (CellIndex (p), n, _template.Format());
     }
+    MarkSpans (Rect (p[0], p[1], n, 1));
+}
+
+/// Returns the index of style \p s in the style table, adding it if needed.
+///
+/// When the table reaches its limit, the styles no cell uses are removed
+/// first, and the others renumbered, so that a canvas redrawn in ever new
+/// colors keeps a table about the size of its cells. The limit is twice
+/// the number of styles kept, so the cost of removing is amortized over
+/// the styles added until the next time. Indexes not held by a cell or
+/// the drawing template are not valid after interning another style.
+///
+uint16_t CGC::InternStyle (const SCellStyle& s)
+{
+    uint16_t i;
+    if (FindStyle (s, i))
+	return i;
+    if (_styles.size() >= _styleLimit)
+	CompactStyles();
+    if (_styles.size() > UINT16_MAX)
+	throw runtime_error ("too many cell styles");
+    AddStyle (s, ++s_LastStyleStamp);
+    return _styles.size() - 1;
+}
+
+/// Returns a hash of style \p s for _styleIndex.
+static uint32_t StyleHash (const SCellStyle& s)
+{
+    const uint32_t c_FnvPrime = 0x01000193;
+    uint32_t h = 0x811c9dc5;
+    h = (h ^ s.fg) * c_FnvPrime;
+    h = (h ^ s.bg) * c_FnvPrime;
+    h = (h ^ s.attrs) * c_FnvPrime;
+    return h ^ (h >> 16);
+}
+
+/// Sets \p i to the index of style \p s. Returns false if the table does not have it.
+bool CGC::FindStyle (const SCellStyle& s, uint16_t& i) const
+{
+    if (_styleIndex.empty())
+	return false;
+    const uint32_t mask = _styleIndex.size() - 1;
+    for (uint32_t h = StyleHash (s);; ++h) {
+	const uint32_t e = _styleIndex[h & mask];
+	if (!e)
+	    return false;
+	if (_styles[e - 1] == s) {
+	    i = e - 1;
+	    return true;
+	}
+    }
+}
+
+/// Appends style \p s, added with \p stamp, to the table.
+void CGC::AddStyle (const SCellStyle& s, uint64_t stamp)
+{
+    _styles.push_back (s);
+    _styleStamps.push_back (stamp);
+    if (2 * _styles.size() > _styleIndex.size())
+	IndexStyles();	// Keeps the hash table at most half full
+    else
+	IndexStyle (_styles.size() - 1);
+}
+
+/// Adds style \p i to the hash table.
+void CGC::IndexStyle (uint16_t i)
+{
+    const uint32_t mask = _styleIndex.size() - 1;
+    uint32_t h = StyleHash (_styles[i]);
+    while (_styleIndex[h & mask])
+	++h;
+    _styleIndex[h & mask] = i + 1;
+}
+
+/// Rebuilds the hash table of the styles, sized for twice as many.
+void CGC::IndexStyles (void)
+{
+    size_t n = 64;
+    while (n < 4 * _styles.size())
+	n *= 2;
+    _styleIndex.resize (n);
+    fill (_styleIndex, 0);
+    for (uoff_t i = 0; i < _styles.size(); ++i)
+	IndexStyle (i);
+}
+
+/// Removes the styles not used by any cell or the template, renumbering the others.
+void CGC::CompactStyles (void)
+{
+    // Mark the used styles, then number them in table order
+    vector<uint32_t> remap (_styles.size());
+    fill (remap, 0);
+    auto mark = [&](const CCharCell& c) {
+	if (c.IsStyled())
+	    remap [c.StyleIndex()] = 1;
+    };
+    CCharCell v;
+    if (_layout == layout_Cells)
+	for (auto& c : _canvas)
+	    mark (c);
+    else {
+	for (auto f : _formats) {
+	    v.SetFormat (f);
+	    mark (v);
+	}
+    }
+    mark (_template);
+    uint32_t nUsed = 0;
+    for (uoff_t i = 0; i < _styles.size(); ++i) {
+	if (remap[i]) {
+	    _styles[nUsed] = _styles[i];
+	    remap[i] = nUsed++;
+	}
+    }
+    _styles.resize (nUsed);
+    _styleStamps.resize (nUsed);
+    for (auto& stamp : _styleStamps)
+	stamp = ++s_LastStyleStamp;	// Tables sharing the old numbering no longer share this one
+    IndexStyles();
+    _styleLimit = min (max (2 * nUsed, c_MinStyleLimit), uint32_t(UINT16_MAX) + 1);
+
+    // Renumber the cells
+    auto renumber = [&](CCharCell& c) {
+	if (c.IsStyled())
+	    c.SetStyleIndex (remap [c.StyleIndex()]);
+    };
+    if (_layout == layout_Cells)
+	for (auto& c : _canvas)
+	    renumber (c);
+    else {
+	for (uoff_t i = 0; i < _formats.size(); ++i) {
+	    v.SetFormat (_formats[i]);
+	    if (v.IsStyled()) {
+		renumber (v);
+		_formats[i] = v.Format();
+		_formatsDirty [i / Width()] = true;
+	    }
+	}
+    }
+    renumber (_template);
+    fill (_rowHashes, 0);
+}
+
+/// Draws with \p fg on \p bg, in any color_t form, with attributes \p attrs.
+///
+/// The cells hold an index of the interned style, so they stay the same
+/// size. The style table must be given to CTerminfo::Image with them.
+///
+void CGC::Style (color_t fg, color_t bg, uint16_t attrs)
+{
+    attrs &= BitMask (uint16_t, attr_Last);
+    _template.attrs = attrs;
+    _template.SetStyleIndex (InternStyle (SCellStyle { fg, bg, attrs }));
+}
+
+/// Uses the style table of \p src, if it extends this one. Returns false if the tables differ.
+///
+/// When one table is a prefix of the other, cells copied from \p src
+/// keep their style indexes, so canvasses exchanging cells, like a screen
+/// cache, share the same style table. Otherwise the styles of copied
+/// cells must be interned with ImportStyle, as the Image overloads
+/// copying from a CGC do.
+///
+/// Each style is stamped when it is added, with a value never used
+/// again. Copied styles keep their stamps, and styles are only appended,
+/// so two tables with the same stamp at an index have the same styles up
+/// to it. Only the last common style is compared, and only the styles
+/// \p src has beyond this table are copied.
+///
+bool CGC::ShareStyles (const CGC& src)
+{
+    const auto n = _styles.size(), nCommon = min (n, src._styles.size());
+    if (nCommon && _styleStamps [nCommon - 1] != src._styleStamps [nCommon - 1])
+	return false;
+    for (auto i = n; i < src._styles.size(); ++i)
+	AddStyle (src._styles[i], src._styleStamps[i]);
+    return true;
+}
+
+/// Uses the style table of \p src, renumbering the styled cells to it.
+///
+/// This replaces ShareStyles for a screen cache when the tables differ,
+/// as after \p src removed its unused styles. Cells with a style \p src
+/// does not have are set to a 0 character, unknown, so that they differ
+/// from any drawn cell.
+///
+void CGC::AdoptStyles (const CGC& src)
+{
+    const CCharCell unknown (0, color_Preserve, color_Preserve);
+    auto adopt = [&](CCharCell& c) {
+	uint16_t i;
+	if (!c.IsStyled())
+	    return;
+	if (src.FindStyle (_styles [c.StyleIndex()], i))
+	    c.SetStyleIndex (i);
+	else
+	    c = unknown;
+    };
+    if (_layout == layout_Cells)
+	for (auto& c : _canvas)
+	    adopt (c);
+    else {
+	CCharCell v;
+	for (uoff_t i = 0; i < _formats.size(); ++i) {
+	    v.c = _chars[i];
+	    v.SetFormat (_formats[i]);
+	    if (v.IsStyled()) {
+		adopt (v);
+		_chars[i] = v.c;
+		_formats[i] = v.Format();
+	    }
+	}
+	fill (_formatsDirty, true);
+    }
+    const bool bStyled = _template.IsStyled();
+    const SCellStyle s = bStyled ? _styles [_template.StyleIndex()] : SCellStyle();
+    _styles = src._styles;
+    _styleStamps = src._styleStamps;
+    _styleIndex = src._styleIndex;
+    _styleLimit = src._styleLimit;
+    if (bStyled)
+	_template.SetStyleIndex (InternStyle (s));
+    fill (_rowHashes, 0);
+}
+
+/// Replaces the style index of \p v, a cell of \p src, with that of its style in this table.
+void CGC::ImportStyle (const CGC& src, CCharCell& v)
+{
+    if (v.IsStyled())
+	v.SetStyleIndex (InternStyle (src._styles [v.StyleIndex()]));
+}
+
+/// Returns palette color \p c as an EColor, or \p def if it is not one.
+static EColor PaletteEColor (color_t c, EColor def)
+{
+    return ((c & ~UINT8_MAX) == colorv_Indexed && (c & UINT8_MAX) < color_Last) ? EColor(c & UINT8_MAX) : def;
+}
+
+/// Replaces the style of the template with EColor colors and plain attributes.
+void CGC::UnstyleTemplate (void)
+{
+    const auto& s = _styles [_template.StyleIndex()];
+    _template.fg = PaletteEColor (s.fg, lightgray);
+    _template.bg = PaletteEColor (s.bg, color_Preserve);
+    _template.ClearAttr (a_styled);
+}
+
+/// Interns the style of the template with its changed attributes.
+void CGC::RestyleTemplate (void)
+{
+    const auto s = _styles [_template.StyleIndex()];
+    Style (s.fg, s.bg, _template.attrs);
 }
 
 static const CGC::Point2d c_ZeroPoint (0, 0);
@@ -14,13 +14,39 @@ namespace utio {
 class CGC {
 public:
     using canvas_t	= vector<CCharCell>;	///< Type of the output buffer.
+    using chars_t	= vector<wchar_t>;	///< Type of the character plane.
+    using formats_t	= vector<uint32_t>;	///< Type of the format plane, of CCharCell::Format values.
+    using styles_t	= vector<SCellStyle>;	///< Type of the style table.
     using coord_t	= gdt::coord_t;
     using dim_t		= gdt::dim_t;
     using Point2d	= gdt::Point2d;
     using Size2d	= gdt::Size2d;
     using Rect		= gdt::Rect;
+    /// Vertical scroll of a block of rows. See FindScrolls.
+    struct SScroll {
+	coord_t	top;	///< First row of the scrolled region.
+	coord_t	bottom;	///< Row after the scrolled region.
+	coord_t	n;	///< Number of rows the contents move up, or down if negative.
+    };
+    using scrolls_t	= vector<SScroll>;
+    /// Columns [first, last) of a row changed since ClearDirty. See Damage.
+    struct SDirtySpan {
+	coord_t	first;	///< First changed column.
+	coord_t	last;	///< Column after the last changed one.
+	inline bool	Empty (void) const	{ return first >= last; }
+    };
+    using damage_t	= vector<SDirtySpan>;	///< Dirty span of each row.
+    using Span		= gdt::Span;
+    using spans_t	= gdt::spans_t;
+    /// How the cells are stored. See SetLayout.
+    enum ELayout {
+	layout_Cells,	///< Whole cells, in Canvas().
+	layout_Planes	///< Characters in Chars() and formats in Formats().
+    };
 public:
 				CGC (void);
+				CGC (const CGC& v) = default;
+    CGC&			operator= (const CGC& v);
     void			Clear (wchar_t c = ' ');
     void			Box (Rect r);
     void			Bar (Rect r, wchar_t c = ' ');
@@ -30,8 +56,16 @@ public:
     void			Image (Rect r, const canvas_t& cells);
     void			Char (Point2d p, wchar_t c);
     void			Text (Point2d p, const string& str);
-    inline const canvas_t&	Canvas (void) const	{ return _canvas; }
-    inline canvas_t&		Canvas (void)		{ return _canvas; }
+    void			Fill (const CCharCell& v);
+    inline const canvas_t&	Canvas (void) const	{ assert (_layout == layout_Cells && "Planar canvasses have Chars and Formats instead"); return _canvas; }
+    inline canvas_t&		Canvas (void)		{ assert (_layout == layout_Cells && "Planar canvasses have Chars and Formats instead"); return _canvas; }
+    inline const chars_t&	Chars (void) const	{ return _chars; }
+    inline chars_t&		Chars (void)		{ return _chars; }
+    inline const formats_t&	Formats (void) const	{ return _formats; }
+    inline formats_t&		Formats (void)		{ return _formats; }
+    inline CCharCell		GetCell (Point2d p) const;
+    void			SetLayout (ELayout l);
+    inline ELayout		Layout (void) const	{ return _layout; }
     inline const Size2d&	Size (void) const	{ return _size; }
     inline dim_t		Width (void) const	{ return _size[0]; }
     inline dim_t		Height (void) const	{ return _size[1]; }
@@ -41,28 +75,84 @@ public:
     inline void			VLine (coord_t x, coord_t y, dim_t l)					{ VLine (Point2d (x, y), l); }
     inline void			GetImage (coord_t x, coord_t y, dim_t w, dim_t h, canvas_t& cells)	{ GetImage (Rect (x, y, w, h), cells); }
     inline void			Image (coord_t x, coord_t y, dim_t w, dim_t h, const canvas_t& cells)	{ Image (Rect (x, y, w, h), cells); }
-    inline void			Image (const CGC& cells)						{ Image (Rect (0, 0, cells.Width(), cells.Height()), cells.Canvas()); }
+    void			Image (const CGC& cells);
+    void			Image (const CGC& cells, const spans_t& spans);
+    void			Image (Point2d p, const CGC& cells, Rect r);
     inline void			Char (coord_t x, coord_t y, wchar_t c)					{ Char (Point2d (x, y), c); }
     inline void			Text (coord_t x, coord_t y, const string& str)				{ Text (Point2d (x, y), str); }
-    inline void			FgColor (EColor c)	{ _template.fg = c; }
-    inline void			BgColor (EColor c)	{ _template.bg = c; }
+    inline void			FgColor (EColor c)	{ Unstyle(); _template.fg = c; }
+    inline void			BgColor (EColor c)	{ Unstyle(); _template.bg = c; }
     inline void			Color (EColor fg, EColor bg = color_Preserve)	{ FgColor(fg); BgColor(bg); }
-    inline void			AttrOn (EAttribute a)	{ _template.SetAttr (a); }
-    inline void			AttrOff (EAttribute a)	{ _template.ClearAttr (a); }
-    inline void			AllAttrsOff (void)	{ _template.attrs = 0; }
+    inline void			AttrOn (EAttribute a)	{ _template.SetAttr (a); Restyle(); }
+    inline void			AttrOff (EAttribute a)	{ _template.ClearAttr (a); Restyle(); }
+    inline void			AllAttrsOff (void)	{ _template.attrs &= (1 << a_styled); Restyle(); }
+    void			Style (color_t fg, color_t bg, uint16_t attrs = 0);
+    uint16_t			InternStyle (const SCellStyle& s);
+    inline const styles_t&	Styles (void) const	{ return _styles; }
+    bool			ShareStyles (const CGC& src);
+    void			AdoptStyles (const CGC& src);
     inline void			Resize (dim_t x,dim_t y){ Resize (Size2d (x, y)); }
     void			Resize (Size2d sz);
     bool			Clip (Rect& r) const;
     bool			Clip (Point2d& r) const;
     inline void			SetTabSize (size_t nts = 8)	{ assert (nts && "Tab size can not be 0"); _tabSize = nts; }
     bool			MakeDiffFrom (const CGC& src);
+    bool			MakeDiffFrom (const CGC& src, spans_t& spans) const;
+    void			FindScrolls (const CGC& from, scrolls_t& scrolls) const;
+    void			Scroll (coord_t top, coord_t bottom, coord_t n);
+    void			MarkDirty (Rect r);
+    void			MarkDirty (void);
+    void			MarkDirty (const damage_t& d);
+    void			ClearDirty (void);
+    bool			Dirty (void) const;
+    inline bool			RowDirty (coord_t y) const	{ return !_dirty[y].Empty(); }
+    inline const damage_t&	Damage (void) const		{ return _dirty; }
 private:
     inline canvas_t::iterator		CanvasAt (Point2d p);
     inline canvas_t::const_iterator	CanvasAt (Point2d p) const;
+    inline size_t		CellIndex (Point2d p) const	{ return p[1] * _size[0] + p[0]; }
+    void			SetCells (Point2d p, dim_t n, const CCharCell& v);
+    inline void			SetCell (Point2d p, const CCharCell& v)	{ SetCells (p, 1, v); }
+    void			SetFormats (size_t i, dim_t n, uint32_t f);
+    void			MarkSpans (Rect r);
+    void			ImportStyle (const CGC& src, CCharCell& v);
+    bool			FindStyle (const SCellStyle& s, uint16_t& i) const;
+    void			AddStyle (const SCellStyle& s, uint64_t stamp);
+    void			IndexStyle (uint16_t i);
+    void			IndexStyles (void);
+    void			CompactStyles (void);
+    static uint32_t		RowHash (const CCharCell* row, dim_t w);
+    uint32_t			RowHash (coord_t y) const;
+    inline void			Unstyle (void)		{ if (_template.IsStyled()) UnstyleTemplate(); }
+    inline void			Restyle (void)		{ if (_template.IsStyled()) RestyleTemplate(); }
+    void			UnstyleTemplate (void);
+    void			RestyleTemplate (void);
 private:
-    canvas_t			_canvas;	///< The output buffer.
+    canvas_t			_canvas;	///< The output buffer, in layout_Cells.
+    chars_t			_chars;		///< Characters of the cells, in layout_Planes.
+    formats_t			_formats;	///< Formats of the cells, in layout_Planes.
+    styles_t			_styles;	///< Styles referenced by styled cells.
+    vector<uint64_t>		_styleStamps;	///< When each style was added, unique across tables. See ShareStyles.
+    vector<uint32_t>		_styleIndex;	///< Hash table of style index + 1, 0 in empty slots. See FindStyle.
+    uint32_t			_styleLimit;	///< Table size at which unused styles are removed. See CompactStyles.
+    damage_t			_dirty;		///< Changed columns of each row.
+    vector<uint8_t>		_formatsDirty;	///< Rows whose formats changed, in layout_Planes.
+    mutable vector<uint32_t>	_rowHashes;	///< Hash of each row, 0 when it must be computed. See RowHash.
     CCharCell			_template;	///< Current drawing values.
     Size2d			_size;		///< Size of the output buffer.
     uint32_t			_tabSize;	///< Tab size as expanded by Text
+    ELayout			_layout;	///< How the cells are stored.
 };
+
+/// Returns the cell at \p p, in either layout.
+inline CCharCell CGC::GetCell (Point2d p) const
+{
+    const auto i = CellIndex (p);
+    if (_layout == layout_Cells)
+	return _canvas[i];
+    CCharCell v (_chars[i]);
+    v.SetFormat (_formats[i]);
+    return v;
+}
+
 } // namespace utio
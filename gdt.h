@@ -43,5 +43,51 @@ public:
     inline Rect		operator- (const Size2d& d) const	{ Rect r (*this); r -= d; return r; }
 };
 
+using rects_t	= vector<Rect>;	///< A region, as rectangles that do not overlap.
+
+/// Returns the part of \p a inside \p b, empty if they do not overlap.
+inline Rect Intersection (const Rect& a, const Rect& b)
+{
+    Rect r (a);
+    simd::pmax (b[0], r[0]);
+    simd::pmin (b[1], r[1]);
+    simd::pmax (r[0], r[1]);
+    return r;
+}
+
+/// Removes \p b from \p region.
+///
+/// Each rectangle overlapping \p b is replaced by up to four: the rows
+/// above and below \p b, and the columns left and right of it.
+///
+inline void Subtract (rects_t& region, const Rect& b)
+{
+    for (uoff_t i = 0; i < region.size();) {
+	const Rect a (region[i]), o (Intersection (a, b));
+	if (o.Empty()) {
+	    ++i;
+	    continue;
+	}
+	region.erase (region.begin() + i);
+	const Rect parts[4] = {
+	    Rect (a[0], Point2d (a[1][0], o[0][1])),
+	    Rect (Point2d (a[0][0], o[1][1]), a[1]),
+	    Rect (Point2d (a[0][0], o[0][1]), Point2d (o[0][0], o[1][1])),
+	    Rect (Point2d (o[1][0], o[0][1]), Point2d (a[1][0], o[1][1]))
+	};
+	for (const auto& p : parts)
+	    if (!p.Empty())
+		region.insert (region.begin() + i++, p);
+    }
+}
+
+/// Cells [first, last) of row y.
+struct Span {
+    coord_t	y;	///< The row.
+    coord_t	first;	///< First column.
+    coord_t	last;	///< Column after the last one.
+};
+using spans_t	= vector<Span>;	///< Spans ordered by row and column.
+
 } // namespace gdt
 } // namespace utio
@@ -90,12 +90,15 @@ void CKeyboard::ReadKeyData (void)
 }
 
 /// Blocks until something is available on stdin. Returns false on \p timeout.
+///
+/// \p timeout is in microseconds, with zero waiting indefinitely.
+///
 bool CKeyboard::WaitForKeyData (long timeout) const
 {
     fd_set fds;
     FD_ZERO (&fds);
     FD_SET (STDIN_FILENO, &fds);
-    struct timeval tv = { 0, timeout };
+    struct timeval tv = { timeout / 1000000, timeout % 1000000 };
     struct timeval* ptv = timeout ? &tv : nullptr;
     errno = 0;
     int rv;
@@ -108,6 +111,50 @@ bool CKeyboard::WaitForKeyData (long timeout) const
     return rv;
 }
 
+/// Asks the terminal whether it supports synchronized update mode.
+///
+/// Sends a DECRQM query for mode 2026 followed by a device attributes
+/// request, which every terminal answers, and waits for the latter up
+/// to \p timeout microseconds. A reply reporting the mode as set or reset
+/// enables synchronized frames in \p rti. Both replies are removed from
+/// the key buffer. Call after Open, so that the replies are not echoed.
+///
+bool CKeyboard::ProbeSyncUpdate (CTerminfo& rti, long timeout)
+{
+    static const char c_Reply[] = "\033[?";
+    if (!isatty (STDIN_FILENO))
+	return rti.SyncUpdate();
+    cout << CTerminfo::SyncUpdateProbe();
+    cout.flush();
+    for (bool bDA = false; !bDA && WaitForKeyData (timeout);) {
+	ReadKeyData();
+	for (auto i = _keydata.find (c_Reply); i != string::npos;) {
+	    unsigned p[2] = {}, np = 0;
+	    auto j = i + strlen(c_Reply);
+	    for (; j < _keydata.size() && (isdigit(_keydata[j]) || _keydata[j] == ';'); ++j) {
+		if (_keydata[j] == ';')
+		    ++np;
+		else if (np < VectorSize(p))
+		    p[np] = p[np] * 10 + _keydata[j] - '0';
+	    }
+	    if (j + (_keydata[j] == '$') >= _keydata.size())
+		break;				// Incomplete, wait for the rest
+	    if (_keydata[j] == 'c')		// DA1: the terminal has answered everything before it
+		bDA = true;
+	    else if (_keydata[j] == '$' && _keydata[++j] == 'y') {
+		if (p[0] == 2026 && p[1] >= 1 && p[1] <= 3)	// Set, reset, or permanently set
+		    rti.SetSyncUpdate (true);
+	    } else {
+		i = _keydata.find (c_Reply, i + 1);
+		continue;
+	    }
+	    _keydata.erase (_keydata.iat(i), j + 1 - i);
+	    i = _keydata.find (c_Reply, i);
+	}
+    }
+    return rti.SyncUpdate();
+}
+
 //----------------------------------------------------------------------
 
 /// Enters UI mode.
@@ -25,6 +25,7 @@ public:
     inline void		LoadKeymap (const CTerminfo& rti)	{ rti.LoadKeystrings (_keymap); }
     wchar_t		GetKey (bool bBlock = true);
     bool		WaitForKeyData (long timeout = 0) const;
+    bool		ProbeSyncUpdate (CTerminfo& rti, long timeout = 100000);
 private:
     void		ReadKeyData (void);
     static void		Error (const char* f) __attribute__((noreturn));
@@ -0,0 +1,146 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "layers.h"
+
+namespace utio {
+
+//----------------------------------------------------------------------
+
+CLayers::CLayers (void)
+:_layers()
+,_exposed()
+,_visible()
+,_damage()
+,_size (0, 0)
+{
+}
+
+/// Returns the layer drawn in \p gc.
+CLayers::layers_t::iterator CLayers::Find (const CGC& gc)
+{
+    auto i = _layers.begin();
+    while (i < _layers.end() && i->gc != &gc)
+	++i;
+    assert (i < _layers.end() && "The CGC is not a layer");
+    return i;
+}
+
+/// Adds \p gc on top of the stack, at \p pos on the canvas.
+void CLayers::Add (CGC& gc, Point2d pos, bool bOpaque)
+{
+    _layers.push_back (SLayer { &gc, pos, bOpaque });
+    _exposed.push_back (_layers.back().Area());
+}
+
+/// Removes the layer drawn in \p gc.
+void CLayers::Remove (const CGC& gc)
+{
+    const auto i = Find (gc);
+    _exposed.push_back (i->Area());
+    _layers.erase (i);
+}
+
+/// Moves the layer drawn in \p gc to \p pos.
+void CLayers::Move (const CGC& gc, Point2d pos)
+{
+    const auto i = Find (gc);
+    if (i->pos == pos)
+	return;
+    _exposed.push_back (i->Area());
+    i->pos = pos;
+    _exposed.push_back (i->Area());
+}
+
+/// Puts the layer drawn in \p gc above all others.
+void CLayers::Raise (const CGC& gc)
+{
+    const auto i = Find (gc);
+    const SLayer l (*i);
+    _layers.erase (i);
+    _layers.push_back (l);
+    _exposed.push_back (l.Area());
+}
+
+//----------------------------------------------------------------------
+
+/// Adds canvas area \p r to the damage of Compose.
+void CLayers::AddDamage (Rect r)
+{
+    r = gdt::Intersection (r, Rect (0, 0, _size[0], _size[1]));
+    if (r.Empty())
+	return;
+    for (coord_t y = r[0][1]; y < r[1][1]; ++y) {
+	auto& d = _damage[y];
+	if (d.Empty())
+	    d = CGC::SDirtySpan { r[0][0], r[1][0] };
+	else {
+	    d.first = min (d.first, r[0][0]);
+	    d.last = max (d.last, r[1][0]);
+	}
+    }
+}
+
+/// Sets _visible to the parts of layer \p i inside \p canvas not hidden by opaque layers above it.
+void CLayers::FindVisible (layers_t::const_iterator i, const Rect& canvas)
+{
+    _visible.clear();
+    _visible.push_back (gdt::Intersection (i->Area(), canvas));
+    for (auto j = i + 1; j < _layers.end() && !_visible.empty(); ++j)
+	if (j->bOpaque)
+	    gdt::Subtract (_visible, j->Area());
+}
+
+/// Copies the visible cells of the layers that changed since the last Compose to \p out.
+///
+/// The damage is gathered in canvas rows, from the areas uncovered or
+/// covered by layer changes, and from the dirty spans of each layer where
+/// it is visible, so that changes hidden by opaque layers cost nothing.
+/// Each layer is then copied, from the bottom up, where it is visible and
+/// damaged; the cost follows the visible damage rather than the area of
+/// the layers. The copied cells are marked dirty in \p out, ready for
+/// Present, and the damage of the layers is cleared. The first Compose,
+/// on a canvas of a new size or after Invalidate, copies all.
+///
+void CLayers::Compose (CGC& out)
+{
+    const Rect canvas (0, 0, out.Width(), out.Height());
+    if (_size != out.Size()) {
+	_size = out.Size();
+	_exposed.clear();
+	_exposed.push_back (canvas);
+    }
+    _damage.resize (out.Height());
+    fill (_damage, CGC::SDirtySpan { 0, 0 });
+    for (const auto& r : _exposed)
+	AddDamage (r);
+    for (auto i = _layers.begin(); i < _layers.end(); ++i) {
+	FindVisible (i, canvas);
+	for (const auto& r : _visible) {
+	    for (coord_t y = r[0][1]; y < r[1][1]; ++y) {
+		const auto& d = i->gc->Damage()[y - i->pos[1]];
+		const coord_t first = max<coord_t> (i->pos[0] + d.first, r[0][0]), last = min<coord_t> (i->pos[0] + d.last, r[1][0]);
+		if (first < last)
+		    AddDamage (Rect (first, y, last - first, 1));
+	    }
+	}
+    }
+    for (auto i = _layers.begin(); i < _layers.end(); ++i) {
+	FindVisible (i, canvas);
+	for (const auto& r : _visible) {
+	    for (coord_t y = r[0][1]; y < r[1][1]; ++y) {
+		const auto& d = _damage[y];
+		const coord_t first = max (d.first, r[0][0]), last = min (d.last, r[1][0]);
+		if (first < last)
+		    out.Image (Point2d (first, y), *i->gc, Rect (first - i->pos[0], y - i->pos[1], last - first, 1));
+	    }
+	}
+    }
+    for (auto& l : _layers)
+	l.gc->ClearDirty();
+    _exposed.clear();
+}
+
+} // namespace utio
@@ -0,0 +1,61 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#pragma once
+#include "gc.h"
+
+namespace utio {
+
+/// Composes a stack of CGC layers, like a main view, popups, and a status bar, into one canvas.
+///
+/// Each layer is drawn in its own CGC and placed at a position on the
+/// canvas. Opaque layers hide everything below them; in transparent ones,
+/// cells with a 0 character show what is below. Compose copies only the
+/// cells that are both visible and changed: those each layer marked dirty
+/// since the last Compose, and those uncovered or covered by adding,
+/// removing, moving, or raising layers. Cells no layer covers are left
+/// as they are, so the bottom layer is usually an opaque one the size of
+/// the canvas. Styled cells are copied with their styles interned in
+/// the style table of the canvas, so each layer may have its own.
+///
+class CLayers {
+public:
+    using coord_t	= gdt::coord_t;
+    using Point2d	= gdt::Point2d;
+    using Size2d	= gdt::Size2d;
+    using Rect		= gdt::Rect;
+    using rects_t	= gdt::rects_t;
+    /// A layer of the stack.
+    struct SLayer {
+	CGC*		gc;		///< Cells of the layer.
+	Point2d		pos;		///< Canvas position of its top left corner.
+	bool		bOpaque;	///< It hides everything below it.
+	inline Rect	Area (void) const	{ return Rect (pos, gc->Size()); }
+    };
+    using layers_t	= vector<SLayer>;
+public:
+			CLayers (void);
+    void		Add (CGC& gc, Point2d pos, bool bOpaque = true);
+    void		Remove (const CGC& gc);
+    void		Move (const CGC& gc, Point2d pos);
+    void		Raise (const CGC& gc);
+    void		Compose (CGC& out);
+    inline void		Invalidate (void)		{ _size = Size2d (0, 0); }
+    inline const layers_t& Layers (void) const	{ return _layers; }
+    inline void		Add (CGC& gc, coord_t x, coord_t y, bool bOpaque = true)	{ Add (gc, Point2d (x, y), bOpaque); }
+    inline void		Move (const CGC& gc, coord_t x, coord_t y)		{ Move (gc, Point2d (x, y)); }
+private:
+    layers_t::iterator	Find (const CGC& gc);
+    void		FindVisible (layers_t::const_iterator i, const Rect& canvas);
+    void		AddDamage (Rect r);
+private:
+    layers_t		_layers;	///< The stack, from the bottom up.
+    rects_t		_exposed;	///< Areas covered or uncovered since the last Compose.
+    rects_t		_visible;	///< Visible parts of a layer, from FindVisible.
+    CGC::damage_t	_damage;	///< Changed columns of each canvas row in Compose.
+    Size2d		_size;		///< Canvas size at the last Compose.
+};
+
+} // namespace utio
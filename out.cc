@@ -0,0 +1,139 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "out.h"
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <errno.h>
+
+namespace utio {
+
+//----------------------------------------------------------------------
+
+/// Constructs an output to file descriptor \p fd.
+COutput::COutput (int fd)
+:_buf()
+,_written (0)
+,_fd (fd)
+{
+}
+
+/*static*/ void COutput::Error (const char* f)
+{
+    throw file_exception (f, "output");
+}
+
+//----------------------------------------------------------------------
+
+/// Writes as much of \p iov as the descriptor accepts. Returns bytes written.
+size_t COutput::WriteV (struct iovec* iov, size_t n)
+{
+    size_t total = 0;
+    while (n) {
+	auto bw = writev (_fd, iov, n);
+	if (bw < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		break;
+	    Error ("writev");
+	}
+	total += bw;
+	for (; n && size_t(bw) >= iov->iov_len; --n, ++iov)	// Skip what was written
+	    bw -= iov->iov_len;
+	if (n) {
+	    iov->iov_base = static_cast<char*>(iov->iov_base) + bw;
+	    iov->iov_len -= bw;
+	}
+    }
+    return total;
+}
+
+/// Writes \p n bytes at \p p after any pending output.
+///
+/// Both are written with one call, and whatever the descriptor does not
+/// accept is kept to be written by Flush. Returns true if nothing is pending.
+///
+bool COutput::Write (const void* p, size_t n)
+{
+    const size_t pending = Pending();
+    struct iovec iov[2] = {
+	{ _buf.iat (_written), pending },
+	{ const_cast<void*>(p), n }
+    };
+    const size_t bw = WriteV (iov, 2);
+    size_t pw = 0;	// Part of p written
+    if (bw < pending)
+	_written += bw;
+    else {
+	Discard();
+	pw = bw - pending;
+    }
+    if (pw < n) {
+	if (_written > _buf.size() / 2) {	// Reclaim the written part before growing
+	    _buf.erase (_buf.begin(), _written);
+	    _written = 0;
+	}
+	_buf.append (static_cast<const char*>(p) + pw, n - pw);
+    }
+    return !Pending();
+}
+
+/// Writes as much pending output as possible. Returns true if all was written.
+bool COutput::Flush (void)
+{
+    if (!Pending())
+	return true;
+    struct iovec iov = { _buf.iat (_written), Pending() };
+    _written += WriteV (&iov, 1);
+    if (!Pending())
+	Discard();
+    return !Pending();
+}
+
+/// Writes all pending output, waiting for the descriptor as necessary.
+///
+/// Returns false if it is not done in \p timeout microseconds between
+/// writes. A zero \p timeout waits as long as it takes.
+///
+bool COutput::Drain (long timeout)
+{
+    while (!Flush())
+	if (!WaitWritable (timeout))
+	    return false;
+    return true;
+}
+
+/// Blocks until the descriptor accepts output. Returns false on \p timeout.
+bool COutput::WaitWritable (long timeout) const
+{
+    fd_set fds;
+    FD_ZERO (&fds);
+    FD_SET (_fd, &fds);
+    struct timeval tv = { timeout / 1000000, timeout % 1000000 };
+    struct timeval* ptv = timeout ? &tv : nullptr;
+    int rv;
+    do {
+	errno = 0;
+	rv = select (_fd + 1, nullptr, &fds, nullptr, ptv);
+    } while (errno == EINTR);
+    if (rv < 0)
+	Error ("select");
+    return rv;
+}
+
+/// Puts the descriptor in nonblocking mode, so that Write never waits.
+void COutput::SetNonblock (bool v)
+{
+    int flag;
+    if ((flag = fcntl (_fd, F_GETFL)) < 0)
+	Error ("F_GETFL");
+    flag = v ? flag | O_NONBLOCK : flag & ~O_NONBLOCK;
+    if (fcntl (_fd, F_SETFL, flag))
+	Error ("F_SETFL");
+}
+
+} // namespace utio
@@ -0,0 +1,46 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#pragma once
+#include "ticonst.h"
+#include <unistd.h>
+
+struct iovec;
+
+namespace utio {
+
+/// Writes terminal output directly to a file descriptor.
+///
+/// Output is written with writev as soon as it is received, and only
+/// the part the descriptor does not accept is copied into the pending
+/// buffer, to be written by later calls. Nonblocking descriptors are
+/// never waited on, so a slow terminal does not stall the event loop;
+/// use Pending to see how far behind it is.
+///
+class COutput {
+public:
+    explicit		COutput (int fd = STDOUT_FILENO);
+			COutput (const COutput&) = delete;
+    void		operator= (const COutput&) = delete;
+    bool		Write (const void* p, size_t n);
+    inline COutput&	operator<< (const string& s)	{ Write (s.data(), s.size()); return *this; }
+    inline COutput&	operator<< (const char* s)	{ Write (s, strlen(s)); return *this; }
+    bool		Flush (void);
+    bool		Drain (long timeout = 0);
+    bool		WaitWritable (long timeout = 0) const;
+    void		SetNonblock (bool v = true);
+    inline void		Discard (void)			{ _buf.clear(); _written = 0; }
+    inline size_t	Pending (void) const		{ return _buf.size() - _written; }
+    inline int		Fd (void) const			{ return _fd; }
+private:
+    size_t		WriteV (struct iovec* iov, size_t n);
+    static void		Error (const char* f) __attribute__((noreturn));
+private:
+    string		_buf;		///< Output not yet accepted by the descriptor.
+    size_t		_written;	///< Part of _buf already written.
+    int			_fd;		///< Where the output goes.
+};
+
+} // namespace utio
@@ -0,0 +1,157 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "screen.h"
+#include <time.h>
+
+namespace utio {
+
+//----------------------------------------------------------------------
+
+/// Constructs a screen on terminal \p rti, written to \p rout.
+CScreen::CScreen (const CTerminfo& rti, COutput& rout)
+:_ti (rti)
+,_out (rout)
+,_shown()
+,_desired()
+,_damage()
+,_nDropped (0)
+,_bDeferred (false)
+{
+}
+
+//----------------------------------------------------------------------
+
+/// Shows \p gc on the terminal, or as soon as it can take it.
+///
+/// If earlier output is still pending, \p gc replaces any frame waiting
+/// for it and false is returned; call Update when the output descriptor
+/// is writable. Frames are best drawn by the same CGC, or by ones sharing
+/// its style table; a frame whose style table does not extend the last
+/// one's is compared whole, after renumbering the shown styles to it.
+///
+/// Only the rows \p gc marks dirty are diffed and written; call its
+/// ClearDirty after Present so that the next frame marks only its own
+/// changes. The damage of a replaced frame is carried into the new one.
+///
+bool CScreen::Present (const CGC& gc)
+{
+    if (_bDeferred) {
+	++_nDropped;
+	_damage = _desired.Damage();
+	_desired = gc;
+	if (_damage.size() == _desired.Damage().size())
+	    _desired.MarkDirty (_damage);
+	else
+	    _desired.MarkDirty();
+    } else
+	_desired = gc;
+    _bDeferred = true;
+    return Update();
+}
+
+/// Writes pending output and then the waiting frame, if there is one.
+///
+/// Returns true when all is written and the terminal shows the newest frame.
+///
+bool CScreen::Update (void)
+{
+    if (_out.Flush() && _bDeferred)
+	WriteFrame();
+    return !_bDeferred && !_out.Pending();
+}
+
+/// Writes the difference between the shown and the newest frame.
+void CScreen::WriteFrame (void)
+{
+    _bDeferred = false;
+    utio::Present (_shown, _desired, _ti, _out);
+}
+
+/// Forgets what the terminal shows, so that the newest frame is rewritten in full by Update.
+void CScreen::Invalidate (void)
+{
+    _shown.Fill (CCharCell (0, color_Preserve, color_Preserve));
+    _desired.MarkDirty();
+    _bDeferred = _desired.Width() && _desired.Height();
+}
+
+//----------------------------------------------------------------------
+
+/// Constructs a scheduler for at most \p maxFps frames per second, with
+/// the first frame after idle presented \p idleLatency microseconds late.
+CFrameScheduler::CFrameScheduler (unsigned maxFps, long idleLatency)
+:_lastFrame (INT64_MIN / 2)
+,_dirtySince (0)
+,_interval (0)
+,_idleLatency (idleLatency)
+,_bDirty (false)
+{
+    SetMaxFps (maxFps);
+}
+
+/// Returns the monotonic clock time in microseconds.
+/*static*/ CFrameScheduler::utime_t CFrameScheduler::Now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return utime_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+/// Limits frames to \p maxFps per second. Zero removes the limit.
+void CFrameScheduler::SetMaxFps (unsigned maxFps)
+{
+    _interval = maxFps ? 1000000 / maxFps : 0;
+}
+
+/// Reports a change to the screen contents.
+void CFrameScheduler::SetDirty (void)
+{
+    if (!_bDirty)
+	_dirtySince = Now();
+    _bDirty = true;
+}
+
+/// Returns when the next frame is due.
+///
+/// The idle latency delays only the first frame of a burst of changes: one
+/// reported when no frame was presented for the frame interval or the idle
+/// latency, whichever is longer. Under continuous changes, frames follow
+/// each other at the frame interval.
+///
+CFrameScheduler::utime_t CFrameScheduler::DueTime (void) const
+{
+    const utime_t nextFrame = _lastFrame + _interval;
+    if (_dirtySince - _lastFrame < max (_interval, _idleLatency))
+	return nextFrame;
+    return max (nextFrame, _dirtySince + _idleLatency);
+}
+
+/// Returns true if a frame should be drawn and presented now.
+bool CFrameScheduler::Due (void) const
+{
+    return _bDirty && Now() >= DueTime();
+}
+
+/// Returns microseconds until the next frame is due, or 0 if none is pending.
+///
+/// The value can be given to CKeyboard::WaitForKeyData, where zero waits
+/// for input indefinitely. A frame that is already due gives 1.
+///
+long CFrameScheduler::Timeout (void) const
+{
+    if (!_bDirty)
+	return 0;
+    return max (DueTime() - Now(), utime_t(1));
+}
+
+/// Records that a frame with all the reported changes was presented.
+void CFrameScheduler::Presented (void)
+{
+    _lastFrame = Now();
+    _bDirty = false;
+}
+
+} // namespace utio
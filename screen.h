@@ -0,0 +1,124 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#pragma once
+#include "ti.h"
+#include "gc.h"
+#include "out.h"
+
+namespace utio {
+
+/// Presents frames drawn in a CGC, dropping those the terminal has no time for.
+///
+/// The screen keeps what the terminal shows once the output is drained,
+/// and the newest frame given to Present. While the output of earlier
+/// frames is still pending, new frames only replace the newest one, and
+/// the difference to it is written by Update when the descriptor drains.
+/// However fast frames are drawn, at most one is waiting to be written.
+///
+class CScreen {
+public:
+    using coord_t	= CGC::coord_t;
+    using dim_t		= CGC::dim_t;
+public:
+			CScreen (const CTerminfo& rti, COutput& rout);
+    bool		Present (const CGC& gc);
+    bool		Update (void);
+    void		Invalidate (void);
+    inline bool		Deferred (void) const	{ return _bDeferred; }
+    inline const CGC&	Shown (void) const	{ return _shown; }
+    inline uint32_t	DroppedFrames (void) const	{ return _nDropped; }
+private:
+    void		WriteFrame (void);
+private:
+    const CTerminfo&	_ti;		///< Terminal capabilities.
+    COutput&		_out;		///< Where the frames are written.
+    CGC			_shown;		///< What the terminal shows when the output is drained.
+    CGC			_desired;	///< The newest frame.
+    CGC::damage_t	_damage;	///< Dirty rows of a replaced frame.
+    uint32_t		_nDropped;	///< Frames replaced before they were written.
+    bool		_bDeferred;	///< _desired is not yet written.
+};
+
+/// Paces redraws of a changing screen.
+///
+/// Changes are reported with SetDirty, and Due says when to draw and
+/// present a frame with all of them. Frames are at least the frame
+/// interval apart, and the first one after an idle period is delayed by
+/// the idle latency, to let a burst of changes collect into one frame.
+/// Timeout returns how long to wait for input before the next frame is
+/// due, suitable for CKeyboard::WaitForKeyData.
+///
+class CFrameScheduler {
+public:
+    using utime_t	= int64_t;	///< Monotonic time in microseconds.
+public:
+    explicit		CFrameScheduler (unsigned maxFps = 60, long idleLatency = 0);
+    void		SetMaxFps (unsigned maxFps);
+    inline void		SetIdleLatency (long usec)	{ _idleLatency = usec; }
+    void		SetDirty (void);
+    inline bool		Dirty (void) const		{ return _bDirty; }
+    bool		Due (void) const;
+    long		Timeout (void) const;
+    void		Presented (void);
+    static utime_t	Now (void);
+private:
+    utime_t		DueTime (void) const;
+private:
+    utime_t		_lastFrame;	///< When the last frame was presented.
+    utime_t		_dirtySince;	///< When the first change since then was reported.
+    long		_interval;	///< Minimum time between frames.
+    long		_idleLatency;	///< Delay of the first frame after changes start.
+    bool		_bDirty;	///< Changes were reported since the last frame.
+};
+
+/// Shows \p back on terminal \p ti, which shows \p front, writing to \p out.
+///
+/// The dirty cells of \p back are compared with \p front, and the ones
+/// that changed are encoded and copied into \p front, so that it again
+/// holds what the terminal shows. Neither canvas is copied whole or
+/// zeroed. Both now hold the frame, which completes the buffer swap:
+/// the damage of \p back is cleared, and the next frame can be drawn
+/// over it. \p out is a COutput, an ostream, or anything taking strings
+/// with <<. The frame is given to it in one string.
+///
+template <typename Sink>
+void Present (CGC& front, CGC& back, const CTerminfo& ti, Sink& out)
+{
+    CGC::spans_t spans;
+    CGC::scrolls_t scrolls;
+    string frame;	// Given to out in one write
+    if (front.Size() != back.Size() || front.Layout() != back.Layout()) {	// Nothing is known about what is shown
+	front = back;	// For its size, layout, and style table
+	front.Fill (CCharCell (0, color_Preserve, color_Preserve));
+	back.MarkDirty();
+    } else if (!front.ShareStyles (back)) {	// Cells of differently numbered styles are compared whole
+	front.AdoptStyles (back);
+	back.MarkDirty();
+    }
+    if (back.MakeDiffFrom (front, spans)) {
+	frame += ti.BeginFrame();
+	if (ti.CanScroll()) {	// When enough rows changed, the ones that moved are scrolled instead of redrawn.
+	    back.FindScrolls (front, scrolls);
+	    for (const auto& s : scrolls) {
+		frame += ti.Scroll (s.top, s.bottom, s.n);
+		front.Scroll (s.top, s.bottom, s.n);
+		back.MarkDirty (CGC::Rect (0, s.top, back.Width(), s.bottom - s.top));
+	    }
+	    if (!scrolls.empty())
+		back.MakeDiffFrom (front, spans);
+	}
+	if (back.Layout() == CGC::layout_Planes)
+	    frame += ti.Image (spans, back.Width(), back.Height(), back.Chars().begin(), back.Formats().begin(), front.Chars().begin(), front.Formats().begin(), back.Styles().begin());
+	else
+	    frame += ti.Image (spans, back.Width(), back.Height(), back.Canvas().begin(), front.Canvas().begin(), back.Styles().begin());
+	front.Image (back, spans);
+	frame += ti.EndFrame();
+	out << frame;
+    }
+    back.ClearDirty();
+}
+
+} // namespace utio
@@ -26,6 +26,7 @@
 #pragma once
 #include "../gc.h"
 #include "../kb.h"
+#include "../screen.h"
 using namespace utio;
 using namespace utio::gdt;
 using namespace ustl;
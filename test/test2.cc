@@ -96,14 +96,9 @@ void CGCTest::Run (void)
     for (wchar_t key = 0; key != 'q';) {
 	Draw (gc);		// Draws the boxes at current positions.
 
-	// Only the differences need to be written, so find them.
-	if (gc.MakeDiffFrom (screen)) {
-	    // gc now has only new stuff, the rest is zeroed out, and isn't drawn.
-	    cout << _ti.Image (0, 0, gc.Width(), gc.Height(), gc.Canvas().begin());
-	    cout.flush();
-	    screen.Image (gc);	// Now apply the same diff to the screen cache.
-	    gc.Image (screen);	// ... and copy it back for a fresh start.
-	}
+	// Only the differences are written, and copied to the screen cache.
+	Present (screen, gc, _ti, cout);
+	cout.flush();
 
 	key = _kb.GetKey();	// Synchronous call.
 
@@ -0,0 +1,197 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "stdmain.h"
+#include "../vt.h"
+
+//----------------------------------------------------------------------
+
+/// Checks the output written for pairs of frames on a terminal model.
+class CFrameTest {
+public:
+		DECLARE_SINGLETON (CFrameTest)
+    void	Run (void);
+private:
+    inline	CFrameTest (void) :_ti(), _vt(), _screen(), _gc() {}
+    size_t	Present (void);
+    bool	Check (const string& name, const CGC& gc);
+private:
+    CTerminfo		_ti;		///< Terminfo access object.
+    CVtModel		_vt;		///< The terminal written to.
+    CGC			_screen;	///< What the terminal shows.
+    CGC			_gc;		///< The next frame.
+};
+
+//----------------------------------------------------------------------
+
+/// Draws a title, a log starting at line \p first, and a \p status line.
+static void DrawLog (CGC& gc, unsigned first, const char* status)
+{
+    string line;
+    gc.Color (lightgray, black);
+    gc.Clear();
+    gc.Color (black, cyan);
+    gc.Bar (0, 0, gc.Width(), 1);
+    gc.Text (1, 0, "Frame corpus");
+    for (unsigned y = 1; y + 1u < gc.Height(); ++y) {
+	const unsigned n = first + y;
+	gc.Color (n % 5 ? lightgray : yellow, black);
+	line.format ("%4u request %u took %u ms", n, n * 7919 % 10007, n % 97);
+	gc.Text (0, y, line);
+    }
+    gc.Color (white, blue);
+    gc.Bar (0, gc.Height() - 1, gc.Width(), 1);
+    gc.Text (1, gc.Height() - 1, status);
+}
+
+/// Draws a dialog box at \p x, \p y in line art.
+static void DrawDialog (CGC& gc, CGC::coord_t x, CGC::coord_t y)
+{
+    gc.Color (black, lightgray);
+    gc.Bar (x, y, 30, 8);
+    gc.Box (x, y, 30, 8);
+    gc.Text (x + 2, y + 2, "Delete 3 files?");
+    gc.Color (white, red);
+    gc.Text (x + 6, y + 5, " Yes ");
+    gc.Color (black, green);
+    gc.Text (x + 18, y + 5, " No ");
+    gc.Char (x + 2, y + 6, acsv_Bullet);
+    gc.Char (x + 3, y + 6, acsv_Checkerboard);
+}
+
+/// Draws a table of 256-color and truecolor cells.
+static void DrawColors (CGC& gc, unsigned shift)
+{
+    for (CGC::coord_t y = 4; y < 12; ++y) {
+	for (CGC::coord_t x = 4; x < 68; ++x) {
+	    if (y < 8)
+		gc.Style (IndexedColor ((x + y * 8 + shift) % 256), IndexedColor (16 + (x * 3 + shift) % 216));
+	    else
+		gc.Style (RGBColor (x * 4, y * 16, shift), RGBColor (255 - x * 3, 0, y * 20), (1 << a_bold) * (x % 2));
+	    gc.Char (x, y, 'A' + (x + y + shift) % 26);
+	}
+    }
+}
+
+/// Draws frame \p n of a truecolor gradient over the whole canvas, every cell in a new style.
+static void DrawGradient (CGC& gc, unsigned n)
+{
+    for (CGC::coord_t y = 0; y < gc.Height(); ++y) {
+	for (CGC::coord_t x = 0; x < gc.Width(); ++x) {
+	    gc.Style (RGBColor (x * 3, y * 10, n), RGBColor (n, 255 - x * 3, y * 10));
+	    gc.Char (x, y, 'a' + (x + n) % 26);
+	}
+    }
+}
+
+//----------------------------------------------------------------------
+
+/// Writes the difference between _screen and _gc to _vt. Returns its size.
+size_t CFrameTest::Present (void)
+{
+    ostringstream frame;
+    utio::Present (_screen, _gc, _ti, frame);
+    _vt << frame.str();
+    return frame.str().size();
+}
+
+/// Prints whether the model shows \p gc.
+bool CFrameTest::Check (const string& name, const CGC& gc)
+{
+    Point2d bad;
+    const bool bOk = _vt.Shows (gc, _ti, &bad);
+    if (bOk)
+	cout.format ("%s: ok\n", name.c_str());
+    else
+	cout.format ("%s: cell %d,%d differs\n", name.c_str(), bad[0], bad[1]);
+    return bOk;
+}
+
+/// Writes each pair of frames and checks that the model shows the second.
+void CFrameTest::Run (void)
+{
+    _ti.Load();
+    _vt.Resize (_ti.Width(), _ti.Height());
+    _screen.Resize (_ti.Width(), _ti.Height());
+    _gc.Resize (_ti.Width(), _ti.Height());
+
+    static const struct {
+	const char*	name;
+	void		(*before)(CGC& gc);
+	void		(*after)(CGC& gc);
+    } c_Corpus[] = {
+	{ "status",
+	    [](CGC& gc) { DrawLog (gc, 0, "Ready 12:00:00"); },
+	    [](CGC& gc) { DrawLog (gc, 0, "Ready 12:00:01"); }},
+	{ "scroll",
+	    [](CGC& gc) { DrawLog (gc, 0, "Following"); },
+	    [](CGC& gc) { DrawLog (gc, 3, "Following"); }},
+	{ "scroll back",
+	    [](CGC& gc) { DrawLog (gc, 40, "Paging"); },
+	    [](CGC& gc) { DrawLog (gc, 20, "Paging"); }},
+	{ "dialog",
+	    [](CGC& gc) { DrawLog (gc, 0, "Ready"); },
+	    [](CGC& gc) { DrawLog (gc, 0, "Confirm"); DrawDialog (gc, 20, 6); }},
+	{ "dialog move",
+	    [](CGC& gc) { DrawLog (gc, 0, "Confirm"); DrawDialog (gc, 20, 6); },
+	    [](CGC& gc) { DrawLog (gc, 0, "Confirm"); DrawDialog (gc, 21, 7); }},
+	{ "erase",
+	    [](CGC& gc) { DrawLog (gc, 0, "Ready"); },
+	    [](CGC& gc) { DrawLog (gc, 0, "Ready"); gc.Color (lightgray, black); gc.Bar (0, 5, gc.Width(), 10); gc.Bar (10, 2, 20, 2); }},
+	{ "repeat",
+	    [](CGC& gc) { DrawLog (gc, 0, "Ready"); },
+	    [](CGC& gc) { DrawLog (gc, 0, "Ready"); gc.Color (green, black); gc.Bar (2, 3, 60, 4, '='); gc.HLine (0, 10, gc.Width()); }},
+	{ "damage",
+	    [](CGC& gc) { DrawLog (gc, 0, "Ready"); },
+	    [](CGC& gc) { gc.Color (yellow, blue); gc.Text (1, gc.Height() - 1, "Busy"); gc.Char (40, 7, '*'); }},
+	{ "colors",
+	    [](CGC& gc) { gc.Color (lightgray, black); gc.Clear(); DrawColors (gc, 0); },
+	    [](CGC& gc) { gc.Color (lightgray, black); gc.Clear(); DrawColors (gc, 1); }},
+	{ "clear",
+	    [](CGC& gc) { DrawLog (gc, 0, "Ready"); DrawDialog (gc, 20, 6); },
+	    [](CGC& gc) { gc.Color (lightgray, black); gc.Clear(); }}
+    };
+    size_t nFailed = 0;
+    // The corpus is drawn with each canvas layout, writing the same bytes.
+    for (auto l : { CGC::layout_Cells, CGC::layout_Planes }) {
+	_screen.SetLayout (l);
+	_gc.SetLayout (l);
+	for (const auto& c : c_Corpus) {
+	    string name (c.name);
+	    if (l == CGC::layout_Planes)
+		name += ", planes";
+	    // Start with a known screen: cleared, then fully drawn with the first frame.
+	    _ti.ResetState();
+	    _vt.Reset();
+	    _screen.Color (lightgray, black);
+	    _screen.Clear();
+	    _gc.MarkDirty();	// _gc no longer matches the screen where undrawn
+	    _gc.Color (lightgray, black);
+	    _gc.AllAttrsOff();
+	    c.before (_gc);
+	    Present();
+	    nFailed += !Check (name, _gc);
+	    c.after (_gc);
+	    const size_t nBytes = Present();
+	    cout.format ("%s: %zu bytes\n", name.c_str(), nBytes);
+	    nFailed += !Check (name, _gc);
+	}
+	// An animation in ever new colors removes the unused styles from the table
+	string name ("gradient");
+	if (l == CGC::layout_Planes)
+	    name += ", planes";
+	for (unsigned n = 0; n < 100; ++n) {
+	    DrawGradient (_gc, n);
+	    Present();
+	}
+	nFailed += !Check (name, _gc);
+	cout.format ("%s: %zu styles\n", name.c_str(), _gc.Styles().size());
+    }
+    cout.format ("%zu frames differ\n", nFailed);
+}
+
+//----------------------------------------------------------------------
+
+StdTestMain (CFrameTest)
@@ -0,0 +1,112 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "stdmain.h"
+#include "../layers.h"
+
+//----------------------------------------------------------------------
+
+/// Composes a stack of layers and prints what each change copies.
+class CLayersTest {
+public:
+		DECLARE_SINGLETON (CLayersTest)
+    void	Run (void);
+private:
+    inline	CLayersTest (void) :_layers(), _out(), _main(), _popup(), _overlay(), _status() {}
+    void	Compose (const char* name);
+    void	PrintStyle (const char* name, Point2d p) const;
+private:
+    CLayers	_layers;	///< The compositor.
+    CGC		_out;		///< The composed canvas.
+    CGC		_main;		///< Opaque view the size of the canvas.
+    CGC		_popup;		///< Opaque box over the view.
+    CGC		_overlay;	///< Transparent marks over both.
+    CGC		_status;	///< Opaque bottom line.
+};
+
+//----------------------------------------------------------------------
+
+/// Composes the layers into _out and prints the cells copied and the canvas.
+void CLayersTest::Compose (const char* name)
+{
+    _out.ClearDirty();
+    _layers.Compose (_out);
+    size_t nCopied = 0;
+    for (const auto& d : _out.Damage())
+	nCopied += max (d.last - d.first, 0);
+    cout.format ("%s: %zu cells copied\n", name, nCopied);
+    for (CGC::coord_t y = 0; y < _out.Height(); ++y) {
+	string line;
+	for (CGC::coord_t x = 0; x < _out.Width(); ++x) {
+	    const wchar_t c = _out.GetCell (Point2d (x, y)).c;
+	    line += c < 0x80 ? char (c) : '#';	// Line art
+	}
+	cout << line << '\n';
+    }
+}
+
+/// Prints the colors and attributes of the composed cell at \p p.
+void CLayersTest::PrintStyle (const char* name, Point2d p) const
+{
+    const auto v (_out.GetCell (p));
+    if (!v.IsStyled())
+	cout.format ("%s: not styled\n", name);
+    else {
+	const auto& s = _out.Styles()[v.StyleIndex()];
+	cout.format ("%s: fg %08x, bg %08x, attrs %x\n", name, s.fg, s.bg, s.attrs);
+    }
+}
+
+/// Changes the layers in turn, composing after each change.
+void CLayersTest::Run (void)
+{
+    _out.Resize (40, 10);
+    _main.Resize (40, 10);
+    _main.Clear ('.');
+    _main.Text (1, 1, "Main view");
+    _popup.Resize (16, 5);
+    _popup.Box (0, 0, 16, 5);
+    _popup.Text (2, 2, "Popup");
+    _overlay.Resize (10, 3);
+    _overlay.Clear (0);
+    _overlay.Text (0, 0, "*");
+    _overlay.Text (9, 2, "*");
+    _status.Resize (40, 1);
+    _status.Clear ('=');
+    _status.Text (1, 0, " Ready ");
+
+    _layers.Add (_main, 0, 0);
+    _layers.Add (_popup, 4, 2);
+    _layers.Add (_overlay, 16, 4, false);
+    _layers.Add (_status, 0, 9);
+    Compose ("initial");
+    Compose ("unchanged");
+    _main.Text (6, 4, "hidden");
+    Compose ("hidden change");
+    _main.Text (30, 4, "shown");
+    _main.Text (6, 9, "hidden");
+    Compose ("shown change");
+    _popup.Text (2, 3, "Moved");
+    _layers.Move (_popup, 20, 3);
+    Compose ("move");
+    _layers.Raise (_overlay);
+    Compose ("raise");
+    _layers.Remove (_popup);
+    Compose ("remove");
+    _out.Resize (30, 8);
+    Compose ("resize");
+    // Each layer interns its first style at the same index
+    _main.Style (RGBColor (255, 0, 0), IndexedColor (17));
+    _main.Text (1, 2, "Red");
+    _overlay.Style (RGBColor (0, 0, 255), IndexedColor (231), 1 << a_bold);
+    _overlay.Text (2, 1, "Blue");
+    Compose ("styles");
+    PrintStyle ("Red", Point2d (1, 2));
+    PrintStyle ("Blue", Point2d (18, 5));
+}
+
+//----------------------------------------------------------------------
+
+StdTestMain (CLayersTest)
@@ -0,0 +1,102 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "stdmain.h"
+#include "../out.h"
+#include <fcntl.h>
+
+//----------------------------------------------------------------------
+
+/// Writes through a COutput to a pipe too small to take it all at once.
+class COutputTest {
+public:
+		DECLARE_SINGLETON (COutputTest)
+    void	Run (void);
+private:
+    inline	COutputTest (void) :_sent(), _received(), _capacity (0) { _pipe[0] = _pipe[1] = -1; }
+		~COutputTest (void);
+    void	Write (COutput& out, size_t n);
+    void	Read (size_t n);
+    void	PrintPending (const char* what, const COutput& out) const;
+private:
+    string	_sent;		///< Everything given to the COutput.
+    string	_received;	///< Everything read from the pipe.
+    size_t	_capacity;	///< Bytes the pipe holds.
+    int		_pipe[2];	///< Read and write ends of the pipe.
+};
+
+//----------------------------------------------------------------------
+
+/// Closes the pipe.
+COutputTest::~COutputTest (void)
+{
+    for (auto fd : _pipe)
+	if (fd >= 0)
+	    close (fd);
+}
+
+/// Writes \p n more bytes of a pattern to \p out.
+void COutputTest::Write (COutput& out, size_t n)
+{
+    string s;
+    for (size_t i = 0; i < n; ++i)
+	s += char ('a' + (_sent.size() + i) % 26);
+    _sent += s;
+    out << s;
+}
+
+/// Reads up to \p n bytes from the pipe, as many as it has.
+void COutputTest::Read (size_t n)
+{
+    char buf [4096];
+    for (ssize_t br; n; n -= br) {
+	if ((br = read (_pipe[0], buf, min (n, sizeof(buf)))) <= 0)
+	    break;
+	_received.append (buf, br);
+    }
+}
+
+/// Prints the output pending in \p out, in eighths of the pipe capacity.
+void COutputTest::PrintPending (const char* what, const COutput& out) const
+{
+    cout.format ("%s: %zu/8 pending\n", what, out.Pending() * 8 / _capacity);
+}
+
+/// Writes more than the pipe holds, reading parts of it in between.
+void COutputTest::Run (void)
+{
+    if (pipe (_pipe) || fcntl (_pipe[0], F_SETFL, O_NONBLOCK))
+	throw runtime_error ("could not create a nonblocking pipe");
+    _capacity = 65536;
+#ifdef F_GETPIPE_SZ
+    const int sz = fcntl (_pipe[1], F_GETPIPE_SZ);
+    if (sz > 0)
+	_capacity = sz;
+#endif
+    COutput out (_pipe[1]);
+    out.SetNonblock();
+
+    Write (out, _capacity / 2);
+    PrintPending ("half the pipe", out);
+    Write (out, _capacity);
+    PrintPending ("one more pipe", out);
+    // The pending part is now written only in part, before any new data
+    Read (_capacity / 4);
+    Write (out, _capacity / 8);
+    PrintPending ("a quarter read, an eighth more", out);
+    Read (_capacity / 2);
+    Write (out, 100);
+    PrintPending ("a half read, 100 bytes more", out);
+    while (out.Pending()) {
+	Read (_capacity);
+	out.Flush();
+    }
+    Read (_capacity);
+    cout << (_sent == _received ? "All output received in order\n" : "Output lost or reordered\n");
+}
+
+//----------------------------------------------------------------------
+
+StdTestMain (COutputTest)
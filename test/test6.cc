@@ -0,0 +1,92 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "stdmain.h"
+#include "../vt.h"
+#include <fcntl.h>
+
+//----------------------------------------------------------------------
+
+/// Presents frames on a CScreen writing to a pipe that is not read in time.
+class CScreenTest {
+public:
+		DECLARE_SINGLETON (CScreenTest)
+    void	Run (void);
+private:
+    inline	CScreenTest (void) :_ti(), _vt(), _gc() { _pipe[0] = _pipe[1] = -1; }
+		~CScreenTest (void);
+    void	Read (void);
+private:
+    CTerminfo	_ti;		///< Terminfo access object.
+    CVtModel	_vt;		///< The terminal reading the pipe.
+    CGC		_gc;		///< The frame drawn.
+    int		_pipe[2];	///< Read and write ends of the pipe.
+};
+
+//----------------------------------------------------------------------
+
+/// Closes the pipe.
+CScreenTest::~CScreenTest (void)
+{
+    for (auto fd : _pipe)
+	if (fd >= 0)
+	    close (fd);
+}
+
+/// Reads all the pipe has into the terminal model.
+void CScreenTest::Read (void)
+{
+    char buf [4096];
+    for (ssize_t br; (br = read (_pipe[0], buf, sizeof(buf))) > 0;)
+	_vt.Write (buf, br);
+}
+
+/// Draws frame \p n, every cell in a different color than in the frame before.
+static void DrawFrame (CGC& gc, unsigned n)
+{
+    for (CGC::coord_t y = 0; y < gc.Height(); ++y) {
+	for (CGC::coord_t x = 0; x < gc.Width(); ++x) {
+	    gc.Style (RGBColor (x * 3, y * 10, n), RGBColor (n, 255 - x * 3, y * 10));
+	    gc.Char (x, y, 'a' + (x + y + n) % 26);
+	}
+    }
+}
+
+/// Presents frames until the pipe is full and several more, then reads them all.
+void CScreenTest::Run (void)
+{
+    if (pipe (_pipe) || fcntl (_pipe[0], F_SETFL, O_NONBLOCK))
+	throw runtime_error ("could not create a nonblocking pipe");
+    COutput out (_pipe[1]);
+    out.SetNonblock();
+    _ti.Load();
+    _vt.Resize (_ti.Width(), _ti.Height());
+    _gc.Resize (_ti.Width(), _ti.Height());
+    CScreen screen (_ti, out);
+
+    unsigned n = 0;
+    while (n < 1000 && !out.Pending()) {
+	DrawFrame (_gc, n++);
+	screen.Present (_gc);
+	_gc.ClearDirty();
+    }
+    cout << (out.Pending() ? "The pipe is full\n" : "The pipe took all frames\n");
+    // Frames presented now replace each other until the pipe drains
+    for (unsigned i = 0; i < 5; ++i) {
+	DrawFrame (_gc, n++);
+	cout << (screen.Present (_gc) ? "Frame written\n" : "Frame deferred\n");
+	_gc.ClearDirty();
+    }
+    for (bool bDone = false; !bDone;) {
+	bDone = screen.Update();
+	Read();
+    }
+    cout << (_vt.Shows (_gc, _ti) ? "The terminal shows the newest frame\n" : "The terminal shows an older frame\n");
+    cout << (screen.DroppedFrames() ? "Frames were dropped\n" : "No frames were dropped\n");
+}
+
+//----------------------------------------------------------------------
+
+StdTestMain (CScreenTest)
@@ -5,7 +5,19 @@
 
 #include "ti.h"
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#if __SSE2__
+    #include <emmintrin.h>
+#endif
+#if __AVX2__
+    #include <immintrin.h>
+#endif
+#include "tibuiltin.h"
 
 //----------------------------------------------------------------------
 
@@ -27,150 +39,716 @@ namespace utio {
 
 //----------------------------------------------------------------------
 
+/// Converts \p h to native byte order and checks the magic number.
+static void NativeTerminfoHeader (STerminfoHeader& h)
+{
+    #if BYTE_ORDER == BIG_ENDIAN
+	h.magic = le_to_native (h.magic);
+	h.namesSize = le_to_native (h.namesSize);
+	h.nBooleans = le_to_native (h.nBooleans);
+	h.nNumbers = le_to_native (h.nNumbers);
+	h.nStrings = le_to_native (h.nStrings);
+	h.strtableSize = le_to_native (h.strtableSize);
+    #endif
+    if (h.magic != TERMINFO_MAGIC || !h.namesSize)
+	throw domain_error ("corrupt terminfo file");
+}
+
+/// Returns the size of the entry described by native header \p h.
+static size_t TerminfoEntrySize (const STerminfoHeader& h)
+{
+    return Align (sizeof(h) + h.namesSize + h.nBooleans, sizeof(int16_t)) +
+	    h.nNumbers * sizeof(int16_t) + h.nStrings * sizeof(uint16_t) + h.strtableSize;
+}
+
+/// Returns the modification time of \p st in ns.
+static uint64_t StatMtime (const struct stat& st)
+{
+    return st.st_mtim.tv_sec * UINT64_C(1000000000) + st.st_mtim.tv_nsec;
+}
+
+//----------------------------------------------------------------------
+
 const char CTerminfo::no_value[1] = "";
 
 /// Default constructor.
 CTerminfo::CTerminfo (void)
 :_name()
-,_booleans()
-,_numbers()
-,_stringOffsets()
-,_stringTable()
+,_entry()
+,_entryBuf()
+,_mapping()
+,_cachedKeymap()
+,_booleans (nullptr)
+,_numbers (nullptr)
+,_stringOffsets (nullptr)
+,_stringTable (nullptr)
+,_syncCap (no_value)
+,_nBooleans (0)
+,_nNumbers (0)
+,_nStrings (0)
+,_stringTableSize (0)
 ,_acsMap()
+,_acsLookup()
+,_acsPages (0)
+,_progCode()
+,_progOffsets()
+,_moveCosts()
+,_index()
 ,_ctx()
+,_formatCache()
+,_nFormatLookups (0)
+,_nFormatHits (0)
+,_stats()
 ,_nColors (16)
 ,_nPairs (64)
 ,_nColumns (80)
 ,_nRows (24)
+,_tabSize (0)
+,_bUtf8 (false)
+,_bDirectColor (false)
+,_bSyncUpdate (false)
 {
 }
 
 /// Default constructor.
 CTerminfo::CContext::CContext (void)
 : output()
+, scratch()
 , progStack()
+, progVars()
 , pos (-1, -1)
+, shownArea()
+, shown (nullptr)
+, cells()
+, shownCells()
+, styles (nullptr)
 , attrs (0)
-, fg (lightgray)
-, bg (black)
+, fg (IndexedColor (lightgray))
+, bg (IndexedColor (black))
+, bCursorHidden (false)
+, bFrameHidCursor (false)
+, bInFrame (false)
+, frameStart (0)
+, nCounted (0)
 {
 }
 
+/// Counts the bytes appended to a string during its lifetime as output of one kind.
+///
+/// Bytes counted by counters nested within its lifetime are excluded, so
+/// that the motion or format output of helpers is not counted as the kind
+/// of output of the method calling them.
+///
+class CTerminfo::COutputCount {
+public:
+    inline		COutputCount (const CTerminfo& ti, EOutputKind k, const string& s)
+			    : _ti (ti), _s (s), _start (s.size()), _nested (ti._ctx.nCounted), _k (k) {}
+    inline		~COutputCount (void) {
+			    const size_t n = _s.size() - _start - (_ti._ctx.nCounted - _nested);
+			    _ti._stats.m_Bytes[_k] += n;
+			    _ti._ctx.nCounted += n;
+			}
+private:
+    const CTerminfo&	_ti;
+    const string&	_s;
+    const size_t	_start;		///< Size of _s before.
+    const size_t	_nested;	///< _ctx.nCounted before.
+    const EOutputKind	_k;
+};
+
 //----------------------------------------------------------------------
 // Terminfo loading
 //----------------------------------------------------------------------
 
+/// Sets \p name to the next more generic terminal after it. Returns false after vt100.
+///
+/// The chain goes from name-variant to name-256color, to name, to vt100;
+/// so xterm-kitty falls back to xterm-256color, xterm, and vt100.
+///
+static bool FallbackTermName (string& name)
+{
+    const auto dash = name.find ('-');
+    if (dash == string::npos) {
+	if (name == "vt100")
+	    return false;
+	name = "vt100";
+    } else {
+	string base (name.c_str(), dash), colors (base);
+	colors += "-256color";
+	if (name == colors)
+	    name = base;
+	else
+	    name = colors;
+    }
+    return true;
+}
+
+/// Returns true if $TERMINFO, $TERMINFO_DIRS, or ~/.terminfo select a local terminfo database.
+static bool HaveLocalTerminfo (void)
+{
+    if (getenv ("TERMINFO") || getenv ("TERMINFO_DIRS"))
+	return true;
+    const char* homedir = getenv ("HOME");
+    if (!homedir || !*homedir)
+	return false;
+    string path (homedir);
+    path += "/.terminfo";
+    struct stat st;
+    return !stat (path.c_str(), &st);
+}
+
+/// Resolves \p termname, or the closest more generic terminal, to an entry file \p path or a built-in entry.
+///
+/// A built-in entry is used without searching for entry files, unless a
+/// local terminfo database may customize it. Then an entry file in the
+/// search path takes precedence over the built-in entry of the same name.
+/// Returns nullptr when \p path is set.
+///
+const CTerminfo::SBuiltinEntry* CTerminfo::ResolveEntry (string& path, const char* termname, bool bBuiltin) const
+{
+    const bool bLocal = bBuiltin && HaveLocalTerminfo();
+    for (string name (termname);;) {
+	auto builtin = bBuiltin ? BuiltinEntry (name.c_str()) : nullptr;
+	if (builtin && !bLocal)
+	    return builtin;
+	if (_index.Find (path, name.c_str()))
+	    return nullptr;
+	if (builtin)
+	    return builtin;
+	if (!FallbackTermName (name))
+	    throw runtime_error ("could not find the terminfo description for your terminal; please update your terminfo database");
+    }
+}
+
+/// Returns the entry for \p termname compiled into the library, or nullptr if there is none.
+const CTerminfo::SBuiltinEntry* CTerminfo::BuiltinEntry (const char* termname)
+{
+    if (!termname)
+	return nullptr;
+    for (auto e = c_BuiltinEntries; e->m_Name; ++e)
+	if (!strcmp (e->m_Name, termname))
+	    return e;
+    return nullptr;
+}
+
 /// Loads terminfo entry \p termname into \p buf
 void CTerminfo::LoadEntry (memblock& buf, const char* termname) const
 {
     string tipath;
-    if (!termname)
-	termname = "linux";
-    const char* defTiPath = getenv ("TERMINFO");
-    if (!defTiPath)
-	defTiPath = "/usr/share/terminfo";
-    if (access (defTiPath, R_OK | X_OK))
-	throw runtime_error ("could not find the terminfo database; please set $TERMINFO environment variable to point to it");
-    tipath.format ("%s/%c/%s", defTiPath, termname[0], termname);
-    if (access (tipath.c_str(), R_OK))
-	throw runtime_error ("could not find the terminfo description for your terminal; please update your terminfo database");
-    buf.read_file (tipath.c_str());
+    if (auto e = ResolveEntry (tipath, termname ? termname : "linux", true))
+	buf.assign (e->m_Data, e->m_Size);
+    else
+	buf.read_file (tipath.c_str());
+}
+
+/// Validates the compiled entry at \p p and points the caps into it.
+///
+/// The entry is used in place, so it must remain valid and unchanged
+/// until the next Unload; callers link _entry to its storage. Numbers
+/// and string offsets stay little-endian and are converted on access.
+///
+void CTerminfo::LinkEntry (const void* p, size_t n)
+{
+    STerminfoHeader h;
+    if (n < sizeof(h))
+	throw domain_error ("corrupt terminfo file");
+    memcpy (&h, p, sizeof(h));
+    NativeTerminfoHeader (h);
+    const size_t esize = TerminfoEntrySize (h);
+    if (esize > n)
+	throw domain_error ("corrupt terminfo file");
+    const auto names = static_cast<const char*>(p) + sizeof(h);
+    _name.assign (names, strnlen (names, h.namesSize));
+    _booleans = reinterpret_cast<const int8_t*>(names + h.namesSize);
+    _numbers = reinterpret_cast<const number_t*>(static_cast<const char*>(p) + Align (sizeof(h) + h.namesSize + h.nBooleans, sizeof(number_t)));
+    _stringOffsets = reinterpret_cast<const stroffset_t*>(_numbers + h.nNumbers);
+    _stringTable = reinterpret_cast<const char*>(_stringOffsets + h.nStrings);
+    _nBooleans = h.nBooleans;
+    _nNumbers = h.nNumbers;
+    _nStrings = h.nStrings;
+    _stringTableSize = h.strtableSize;
+}
+
+/// Maps the compiled entry file \p path read-only and links to it.
+void CTerminfo::MapEntry (const char* path)
+{
+    const int fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+	throw file_exception ("open", path);
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (!fstat (fd, &st) && st.st_size > 0)
+	p = mmap (nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (p == MAP_FAILED)
+	throw file_exception ("mmap", path);
+    _mapping.link (p, st.st_size);
+    _entry.link (p, st.st_size);
+    LinkEntry (p, st.st_size);
+}
+
+/// Releases the loaded entry.
+void CTerminfo::Unload (void)
+{
+    if (_mapping.size())
+	munmap (const_cast<char*>(_mapping.begin()), _mapping.size());
+    _mapping.unlink();
+    _cachedKeymap.unlink();
+    _entry.unlink();
+    _entryBuf.clear();
+    _name.clear();
+    _booleans = nullptr;
+    _numbers = nullptr;
+    _stringOffsets = nullptr;
+    _stringTable = nullptr;
+    _syncCap = no_value;
+    _nBooleans = _nNumbers = _nStrings = _stringTableSize = 0;
+    _formatCache.clear();
+    _nFormatLookups = _nFormatHits = 0;
 }
 
 /// Reads the terminfo entry from stream \p is.
 void CTerminfo::read (istream& is)
 {
-    // First the header.
     STerminfoHeader h;
     #if WANT_STREAM_BOUNDS_CHECKING
 	memset (&h, 0, sizeof(h));
     #else
 	is.verify_remaining ("read","terminfo",stream_size_of(h));
     #endif
+    const auto start = is.ipos();
     is >> h;
-    #if BYTE_ORDER == BIG_ENDIAN
-	h.magic = le_to_native (h.magic);
-	h.namesSize = le_to_native (h.namesSize);
-	h.nBooleans = le_to_native (h.nBooleans);
-	h.nNumbers = le_to_native (h.nNumbers);
-	h.nStrings = le_to_native (h.nStrings);
-	h.strtableSize = le_to_native (h.strtableSize);
-    #endif
-    if (h.magic != TERMINFO_MAGIC)
-	throw domain_error ("corrupt terminfo file");
-
-    // The names section
-    is.read_strz (_name);
-
-    // The boolean section
-    is.verify_remaining ("read","terminfo",sizeof(boolvec_t::size_type)+h.nBooleans*sizeof(boolvec_t::value_type));
-    _booleans.resize (h.nBooleans);
-    nr_container_read (is, _booleans);
-    is >> ios::talign<number_t>();
-
-    // The numbers section
-    is.verify_remaining ("read","terminfo",sizeof(numvec_t::size_type)+h.nNumbers*sizeof(numvec_t::value_type));
-    _numbers.resize (h.nNumbers);
-    nr_container_read (is, _numbers);
-
-    // The string offsets section
-    is.verify_remaining ("read","terminfo",sizeof(stroffvec_t::size_type)+h.nStrings*sizeof(stroffvec_t::value_type));
-    _stringOffsets.resize (h.nStrings);
-    nr_container_read (is, _stringOffsets);
-
-    // The stringtable
-    is.verify_remaining ("read","terminfo",h.strtableSize);
-    _stringTable.resize (h.strtableSize);
-    is.read (_stringTable.begin(), _stringTable.size());
-
-#if BYTE_ORDER == BIG_ENDIAN
-    for (auto& i : _numbers) i = le_to_native (i);
-    for (auto& i : _stringOffsets) i = le_to_native (i);
-#endif
+    NativeTerminfoHeader (h);
+    const size_t esize = TerminfoEntrySize (h);
+    is.verify_remaining ("read","terminfo",esize - sizeof(h));
+    Unload();
+    _entryBuf.assign (start, esize);
+    is.skip (esize - sizeof(h));
+    _entry.link (_entryBuf.begin(), _entryBuf.size());
+    LinkEntry (_entry.begin(), _entry.size());
 }
 
 /// Writes a terminfo entry into stream \p os
 void CTerminfo::write (ostream& os) const
 {
-    STerminfoHeader h;
-    h.magic = native_to_le<uint16_t> (TERMINFO_MAGIC);
-    h.namesSize = native_to_le (_name.size() + 1);
-    h.nBooleans = native_to_le (_booleans.size());
-    h.nNumbers = native_to_le (_numbers.size());
-    h.nStrings = native_to_le (_stringOffsets.size());
-    h.strtableSize = native_to_le (_stringTable.size());
-    os << h;
-    os.write_strz (_name);
-    nr_container_write (os, _booleans);
-    os << ios::talign<number_t>();
-    for (auto i : _numbers) os << native_to_le (i);
-    for (auto i : _stringOffsets) os << native_to_le (i);
-    os.write (_stringTable.begin(), _stringTable.size());
+    os.write (_entry.begin(), _entry.size());
 }
 
 /// Returns the written size of the terminfo entry.
 size_t CTerminfo::stream_size (void) const
 {
-    return stream_size_of(STerminfoHeader()) +
-	    Align (_name.size() + _booleans.size(), __alignof__(number_t)) +
-	    _numbers.size() * sizeof(number_t) +
-	    _stringOffsets.size() * sizeof(stroffset_t) +
-	    _stringTable.size();
+    return _entry.size();
+}
+
+//----------------------------------------------------------------------
+// Entry search path index
+//----------------------------------------------------------------------
+
+/// Sets the search path from $TERMINFO, ~/.terminfo, and $TERMINFO_DIRS.
+///
+/// An empty component of $TERMINFO_DIRS stands for the system
+/// directories, which are also searched when it is not set.
+///
+void CTerminfo::CEntryIndex::LoadSearchPath (void)
+{
+    static const char* const c_SystemDirs[] = { "/etc/terminfo", "/lib/terminfo", "/usr/share/terminfo" };
+    const char *terminfo = getenv ("TERMINFO"), *homedir = getenv ("HOME"), *dirs = getenv ("TERMINFO_DIRS");
+    if (terminfo && *terminfo)
+	_searchPath.push_back (string (terminfo));
+    if (homedir && *homedir) {
+	_searchPath.push_back (string (homedir));
+	_searchPath.back() += "/.terminfo";
+    }
+    for (dirs = dirs ? dirs : "";; ++dirs) {
+	const char* dirend = strchr (dirs, ':');
+	const size_t dirlen = dirend ? dirend - dirs : strlen (dirs);
+	if (dirlen)
+	    _searchPath.push_back (string (dirs, dirlen));
+	else for (auto sdir : c_SystemDirs)
+	    _searchPath.push_back (string (sdir));
+	if (!dirend)
+	    break;
+	dirs = dirend;
+    }
+}
+
+/// Returns the index of the first entry in _entries not less than \p name.
+uoff_t CTerminfo::CEntryIndex::LowerBound (const char* name) const
+{
+    uoff_t first = 0, last = _entries.size();
+    while (first < last) {
+	const uoff_t mid = (first + last) / 2;
+	if (strcmp (_pool.c_str() + _entries[mid].m_Name, name) < 0)
+	    first = mid + 1;
+	else
+	    last = mid;
+    }
+    return first;
+}
+
+/// Appends \p n characters of \p name to _pool and returns its offset.
+uint32_t CTerminfo::CEntryIndex::AddName (const char* name, size_t n)
+{
+    const uint32_t offset = _pool.size();
+    _pool.append (name, n);
+    _pool += '\0';
+    return offset;
+}
+
+/// Adds alias \p name for \p file in \p dir, or a new file if \p file is UINT32_MAX, unless the name is already present.
+void CTerminfo::CEntryIndex::Add (const char* name, size_t n, uint32_t file, uint32_t dir)
+{
+    const string sname (name, n);
+    const uoff_t i = LowerBound (sname.c_str());
+    if (i < _entries.size() && sname == _pool.c_str() + _entries[i].m_Name)
+	return;	// Earlier directories in the search path have priority.
+    const uint32_t nameOffset = AddName (name, n);
+    const SEntry e = { nameOffset, file == UINT32_MAX ? nameOffset : file, dir };
+    _entries.insert (_entries.begin() + i, e);
+}
+
+/// Adds the entry files in \p dir to the index.
+void CTerminfo::CEntryIndex::ScanDir (const char* dir)
+{
+    DIR* d = opendir (dir);
+    if (!d)
+	return;
+    const uint32_t diri = _dirs.size();
+    _dirs.push_back (string (dir));
+    for (const struct dirent* de; (de = readdir (d));)
+	if (de->d_name[0] != '.')
+	    Add (de->d_name, strlen (de->d_name), UINT32_MAX, diri);
+    closedir (d);
+}
+
+/// Sets \p path to the entry file of \p termname. Returns false if there is none.
+bool CTerminfo::CEntryIndex::Find (string& path, const char* termname)
+{
+    const uint8_t c = termname[0];
+    if (!c || strchr (termname, '/'))
+	return false;
+    if (!_scanned.test (c)) {
+	_scanned.set (c);
+	if (_searchPath.empty())
+	    LoadSearchPath();
+	string dir;
+	for (const auto& sdir : _searchPath) {
+	    dir.format ("%s/%c", sdir.c_str(), c);
+	    ScanDir (dir.c_str());
+	    dir.format ("%s/%02x", sdir.c_str(), c);
+	    ScanDir (dir.c_str());
+	}
+    }
+    const uoff_t i = LowerBound (termname);
+    if (i >= _entries.size() || strcmp (_pool.c_str() + _entries[i].m_Name, termname))
+	return false;
+    path.format ("%s/%s", _dirs[_entries[i].m_Dir].c_str(), _pool.c_str() + _entries[i].m_File);
+    return true;
+}
+
+/// Appends to \p stamps the modification times of the directories Find lists for the first letters in \p letters.
+///
+/// Missing directories give 0. Entry files are added, removed, or renamed
+/// only by changing their directory, so while these times are unchanged,
+/// names with these first letters resolve to the same files.
+///
+void CTerminfo::CEntryIndex::DirStamps (const char* letters, vector<uint64_t>& stamps)
+{
+    if (_searchPath.empty())
+	LoadSearchPath();
+    string dir;
+    struct stat st;
+    for (; *letters; ++letters) {
+	for (const auto& sdir : _searchPath) {
+	    dir.format ("%s/%c", sdir.c_str(), *letters);
+	    stamps.push_back (stat (dir.c_str(), &st) ? 0 : StatMtime (st));
+	    dir.format ("%s/%02x", sdir.c_str(), uint8_t(*letters));
+	    stamps.push_back (stat (dir.c_str(), &st) ? 0 : StatMtime (st));
+	}
+    }
+}
+
+/// Adds the terminal names in the \p names section of the entry loaded from \p path.
+void CTerminfo::CEntryIndex::AddAliases (const char* names, const char* path)
+{
+    const char* filename = strrchr (path, '/');
+    const uoff_t i = filename ? LowerBound (++filename) : _entries.size();
+    if (i >= _entries.size() || strcmp (_pool.c_str() + _entries[i].m_Name, filename))
+	return;
+    const uint32_t file = _entries[i].m_File, dir = _entries[i].m_Dir;
+    // The last name is the terminal description
+    for (const char* nameend; (nameend = strchr (names, '|')); names = nameend + 1)
+	if (!memchr (names, '/', nameend - names))
+	    Add (names, nameend - names, file, dir);
+}
+
+//----------------------------------------------------------------------
+// Decoded entry cache
+//----------------------------------------------------------------------
+
+enum {
+    TICACHE_MAGIC = 0x43495455,	// "UTIC" on little-endian hosts
+    TICACHE_VERSION = 6
+};
+
+/// Header of the decoded entry cache file.
+///
+/// The file is the header; the source path, search path, and searched
+/// letters strings; the search directory stamps aligned to 8 bytes; the
+/// compiled entry; the compiled programs; and the keymap. All values are
+/// in native byte order; the cache is per-host.
+///
+struct CTerminfo::SCacheHeader {
+    uint32_t	magic;		///< TICACHE_MAGIC, also detects byte order.
+    uint16_t	version;	///< TICACHE_VERSION
+    uint16_t	keySize;	///< Size of the source path, search path, and letters strings.
+    uint64_t	srcMtime;	///< Modification time of the source entry, in ns.
+    uint64_t	srcSize;	///< Size of the source entry.
+    uint32_t	entrySize;	///< Size of the compiled entry.
+    uint32_t	progCodeSize;	///< Size of _progCode.
+    uint32_t	keymapSize;	///< Size of the keymap from LoadKeystrings.
+    uint16_t	nColors;
+    uint16_t	nPairs;
+    uint16_t	tabSize;
+    uint16_t	nStamps;	///< Number of search directory stamps, from CEntryIndex::DirStamps.
+    uint16_t	progOffsets [prog_Last];
+    uint8_t	moveCosts [mc_Last];
+};
+
+/// Sets \p path to the cache file of \p termname. Returns false if there is no cache location.
+static bool CacheFilePath (string& path, const char* termname, bool bCreateDir)
+{
+    if (strchr (termname, '/'))
+	return false;
+    const char *cachedir = getenv ("XDG_CACHE_HOME"), *homedir = getenv ("HOME");
+    if (cachedir && *cachedir)
+	path = cachedir;
+    else if (homedir && *homedir) {
+	path = homedir;
+	path += "/.cache";
+    } else
+	return false;
+    if (bCreateDir)
+	mkdir (path.c_str(), 0700);
+    path += "/" UTIO_NAME;
+    if (bCreateDir)
+	mkdir (path.c_str(), 0700);
+    path += '/';
+    path += termname;
+    return true;
+}
+
+/// Sets \p env to the environment variables selecting the terminfo search path.
+static void SearchPathEnv (string& env)
+{
+    const char *terminfo = getenv ("TERMINFO"), *homedir = getenv ("HOME"), *dirs = getenv ("TERMINFO_DIRS");
+    env.format ("%s:%s:%s", terminfo ? terminfo : "", homedir ? homedir : "", dirs ? dirs : "");
+}
+
+/// Loads the decoded entry \p termname from the cache file, if it is current.
+///
+/// The cache is current when it was written with the same search path
+/// environment, from an entry file that is unchanged, and the directories
+/// searched for it have the same stamps. Then \p termname still resolves
+/// to that file, without listing the directories again; an entry added
+/// earlier in the search path, like a new one in ~/.terminfo, changes a
+/// stamp. The cache directory is writable by the user, so the programs
+/// and the keymap are checked before use, like the entry is by LinkEntry.
+///
+bool CTerminfo::LoadCache (const char* termname)
+{
+    string path;
+    if (!CacheFilePath (path, termname, false))
+	return false;
+    const int fd = open (path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+	return false;
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (!fstat (fd, &st) && size_t(st.st_size) > sizeof(SCacheHeader))
+	p = mmap (nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (p == MAP_FAILED)
+	return false;
+    Unload();
+    _mapping.link (p, st.st_size);
+
+    // Check that the cache matches this host, version, and source entry
+    const auto& h = *static_cast<const SCacheHeader*>(p);
+    const size_t stampsOffset = Align (sizeof(h) + h.keySize, 8);
+    const size_t entryOffset = stampsOffset + h.nStamps * sizeof(uint64_t);
+    const char* srcPath = _mapping.begin() + sizeof(h);
+    const char* entry = _mapping.begin() + entryOffset;
+    const char* progCode = entry + h.entrySize;
+    const char* keymap = progCode + h.progCodeSize;
+    string envSearchPath;
+    SearchPathEnv (envSearchPath);
+    bool bValid = h.magic == TICACHE_MAGIC && h.version == TICACHE_VERSION
+		&& entryOffset + h.entrySize + h.progCodeSize + h.keymapSize <= _mapping.size()
+		&& h.keySize && !srcPath[h.keySize - 1];
+    const char *keyEnd = srcPath + h.keySize, *keySearchPath = nullptr, *keyLetters = nullptr;
+    if (bValid) {
+	keySearchPath = srcPath + strlen (srcPath) + 1;
+	keyLetters = keySearchPath < keyEnd ? keySearchPath + strlen (keySearchPath) + 1 : keyEnd;
+	bValid = keyLetters < keyEnd
+		&& envSearchPath == keySearchPath
+		&& !stat (srcPath, &st) && StatMtime (st) == h.srcMtime && uint64_t(st.st_size) == h.srcSize;
+    }
+    if (bValid) {
+	vector<uint64_t> stamps;
+	_index.DirStamps (keyLetters, stamps);
+	bValid = stamps.size() == h.nStamps
+		&& equal (stamps.begin(), stamps.end(), reinterpret_cast<const uint64_t*>(_mapping.begin() + stampsOffset));
+    }
+    if (bValid)
+	bValid = ValidPrograms (reinterpret_cast<const uint8_t*>(progCode), h.progCodeSize, h.progOffsets)
+		&& h.keymapSize && !keymap[h.keymapSize - 1]
+		&& count (keymap, keymap + h.keymapSize, '\0') == kv_nKeys;
+    if (bValid) {
+	try {
+	    LinkEntry (entry, h.entrySize);
+	} catch (...) {
+	    bValid = false;
+	}
+    }
+    if (!bValid) {
+	Unload();
+	return false;
+    }
+
+    // Use the decoded values
+    _entry.link (entry, h.entrySize);
+    _nColors = h.nColors;
+    _nPairs = h.nPairs;
+    _tabSize = h.tabSize;
+    copy_n (h.progOffsets, prog_Last, _progOffsets.begin());
+    copy_n (h.moveCosts, mc_Last, _moveCosts.begin());
+    DecodeAcs();
+    _syncCap = GetExtString ("Sync");
+    _bSyncUpdate = _syncCap != no_value;
+    _progCode.assign (reinterpret_cast<const uint8_t*>(progCode), reinterpret_cast<const uint8_t*>(keymap));
+    _cachedKeymap.link (keymap, h.keymapSize);
+    return true;
+}
+
+/// Writes the decoded entry \p termname, loaded from \p srcPath, to its cache file.
+void CTerminfo::SaveCache (const char* termname, const char* srcPath) const
+{
+    string path;
+    struct stat st;
+    if (!CacheFilePath (path, termname, true) || stat (srcPath, &st))
+	return;
+    string envSearchPath;
+    SearchPathEnv (envSearchPath);
+    // Stamp the directories searched for termname, up to the one with srcPath
+    string letters, resolved;
+    for (string name (termname);;) {
+	if (letters.find (name[0]) == string::npos)
+	    letters += name[0];
+	if ((_index.Find (resolved, name.c_str()) && resolved == srcPath) || !FallbackTermName (name))
+	    break;
+    }
+    vector<uint64_t> stamps;
+    _index.DirStamps (letters.c_str(), stamps);
+    keystrings_t keymap;
+    LoadKeystrings (keymap);
+
+    SCacheHeader h;
+    memset (&h, 0, sizeof(h));
+    h.magic = TICACHE_MAGIC;
+    h.version = TICACHE_VERSION;
+    h.keySize = strlen (srcPath) + 1 + envSearchPath.size() + 1 + letters.size() + 1;
+    h.srcMtime = StatMtime (st);
+    h.srcSize = st.st_size;
+    h.entrySize = stream_size();
+    h.progCodeSize = _progCode.size();
+    h.keymapSize = keymap.size();
+    h.nColors = _nColors;
+    h.nPairs = _nPairs;
+    h.tabSize = _tabSize;
+    h.nStamps = stamps.size();
+    copy_n (_progOffsets.begin(), prog_Last, h.progOffsets);
+    copy_n (_moveCosts.begin(), mc_Last, h.moveCosts);
+
+    memblock buf (Align (sizeof(h) + h.keySize, 8) + h.nStamps * sizeof(uint64_t) + h.entrySize + h.progCodeSize + h.keymapSize);
+    memset (buf.begin(), 0, buf.size());
+    ostream os (buf);
+    os.write (&h, sizeof(h));
+    os.write_strz (srcPath);
+    os.write_strz (envSearchPath.c_str());
+    os.write_strz (letters.c_str());
+    os.align (8);
+    os.write (stamps.begin(), stamps.size() * sizeof(uint64_t));
+    write (os);
+    os.write (_progCode.begin(), _progCode.size());
+    os.write (keymap.begin(), keymap.size());
+
+    // Written to a temporary file and renamed to atomically replace the old one.
+    string tmppath;
+    tmppath.format ("%s.%d", path.c_str(), getpid());
+    try {
+	buf.write_file (tmppath.c_str(), 0600);
+    } catch (...) {
+	unlink (tmppath.c_str());
+	return;
+    }
+    if (rename (tmppath.c_str(), path.c_str()))
+	unlink (tmppath.c_str());
+}
+
+//----------------------------------------------------------------------
+
+/// Returns true if the character encoding of the locale environment is UTF-8.
+static bool LocaleIsUtf8 (void)
+{
+    static const char* const c_LocaleVars[] = { "LC_ALL", "LC_CTYPE", "LANG" };
+    const char* locale = nullptr;
+    for (auto v : c_LocaleVars)
+	if ((locale = getenv (v)) && *locale)
+	    break;
+    return locale && (strcasestr (locale, "UTF-8") || strcasestr (locale, "utf8"));
 }
 
 /// Loads the terminfo entry \p termname.
-void CTerminfo::Load (const char* termname)
+///
+/// With load_Builtin in \p flags, an entry compiled into the library is
+/// used without searching for an entry file, unless $TERMINFO,
+/// $TERMINFO_DIRS, or ~/.terminfo select a local database that has one.
+/// With load_Map, the entry file is mapped and used in place instead of being read into memory. With
+/// load_Cache, the decoded entry is loaded from the cache file when it is
+/// current with the source entry, and is otherwise decoded and saved there.
+/// With load_Utf8, UTF-8 output is selected when the locale uses UTF-8.
+///
+void CTerminfo::Load (const char* termname, unsigned flags)
 {
+    if (flags & load_Utf8)
+	_bUtf8 = LocaleIsUtf8();
     if (!termname || !*termname)
 	termname = getenv ("TERM");
     if (!termname || !*termname)
 	termname = "linux";
-    string tibuf;
-    LoadEntry (tibuf, termname);
-    istream is (tibuf);
-    read (is);
+    if ((flags & load_Cache) && LoadCache (termname))
+	return ObtainTerminalParameters();
+    string tipath;
+    const SBuiltinEntry* builtin = ResolveEntry (tipath, termname, flags & load_Builtin);
+    Unload();
+    if (builtin) {
+	_entry.link (builtin->m_Data, builtin->m_Size);
+	LinkEntry (_entry.begin(), _entry.size());
+    } else if (flags & load_Map)
+	MapEntry (tipath.c_str());
+    else {
+	_entryBuf.read_file (tipath.c_str());
+	_entry.link (_entryBuf.begin(), _entryBuf.size());
+	LinkEntry (_entry.begin(), _entry.size());
+    }
     CacheFrequentValues();
     ObtainTerminalParameters();
+    if (!builtin) {
+	_index.AddAliases (_name.c_str(), tipath.c_str());
+	if (flags & load_Cache)
+	    SaveCache (termname, tipath.c_str());
+    }
 }
 
 /// Caches frequently used, but badly formatted caps.
@@ -184,19 +762,83 @@ void CTerminfo::CacheFrequentValues (void)
     if (_nPairs == uint16_t(ti::no_value))
 	_nPairs = 64;
 
-    // Decode the ACS capability, if present.
-    const string acsString (GetString (ti::acs_chars));
+    DecodeAcs();
+    CompilePrograms();
+    _syncCap = GetExtString ("Sync");
+    _bSyncUpdate = _syncCap != no_value;
+
+    // Cursor motion costs for MoveCursor.
+    for (uoff_t i = 0; i < mc_Last; ++i)
+	_moveCosts[i] = min (strlen (GetString (c_MoveCaps[i])), size_t(UINT8_MAX));
+    if (!strcmp (GetString (ti::cursor_down), "\n"))
+	_moveCosts[mc_Down] = 0;	// The tty converts it to CRLF
+    _tabSize = max (GetNumber (ti::init_tabs), number_t(0));
+}
+
+/// Decodes the ACS capability into _acsMap and the Unicode lookup table for it.
+///
+/// The table has two levels: a page index by (c >> acsl_PageBits), and
+/// pages of acsl_PageSize entries, with page 0 empty for all pages without
+/// ACS characters. Each entry is the character to output, with
+/// acsl_Altcharset set when it must be drawn in the alternate charset.
+///
+void CTerminfo::DecodeAcs (void)
+{
+    uint32_t fromAcsc = 0;	// Bitmask of characters specified in the cap
     for (uoff_t i = 0; i < acs_Last; ++i)
 	_acsMap[i] = c_AcscInfo[i].m_Default;
+    const string acsString (GetString (ti::acs_chars));
     if (!acsString.empty()) {
 	const auto cFirst = c_AcscInfo, cLast = cFirst + acs_Last;
-	for (auto i = acsString.begin(); i < acsString.end(); i += 2)
-	    for (auto cFound = cFirst; cFound < cLast; ++cFound)
-		if (cFound->m_vt100Code == *i)
+	for (auto i = acsString.begin(); i < acsString.end(); i += 2) {
+	    for (auto cFound = cFirst; cFound < cLast; ++cFound) {
+		if (cFound->m_vt100Code == *i) {
 		    _acsMap [distance (cFirst, cFound)] = *(i + 1);
+		    fromAcsc |= 1u << distance (cFirst, cFound);
+		}
+	    }
+	}
+    }
+
+    // Assign pages to code points
+    _acsPages = 0;
+    for (uoff_t i = 0; i < acs_Last; ++i)
+	_acsPages = max (_acsPages, uint16_t((c_AcscInfo[i].m_Unicode >> acsl_PageBits) + 1));
+    vector<uint8_t> pages (_acsPages, 0);
+    uint8_t nPages = 1;
+    for (uoff_t i = 0; i < acs_Last; ++i) {
+	auto& page = pages [c_AcscInfo[i].m_Unicode >> acsl_PageBits];
+	if (!page)
+	    page = nPages++;
+    }
+
+    // Fill in the table
+    _acsLookup.assign (_acsPages + nPages * acsl_PageSize, 0);
+    copy (pages.begin(), pages.end(), _acsLookup.begin());
+    for (uoff_t i = 0; i < acs_Last; ++i) {
+	const auto u = c_AcscInfo[i].m_Unicode;
+	auto v = uint8_t(_acsMap[i] & ~acsl_Altcharset);
+	if (fromAcsc & (1u << i))
+	    v |= acsl_Altcharset;
+	_acsLookup [_acsPages + pages[u >> acsl_PageBits] * acsl_PageSize + u % acsl_PageSize] = v;
     }
 }
 
+/// Returns true if the tty on \p fd expands output tabs into spaces.
+static bool TtyExpandsTabs (int fd)
+{
+    struct termios tios;
+    if (tcgetattr (fd, &tios))
+	return false;
+#if defined(TABDLY) && defined(TAB3)
+    return (tios.c_oflag & TABDLY) == TAB3;
+#elif defined(OXTABS)
+    return tios.c_oflag & OXTABS;
+#else
+    return false;
+#endif
+}
+
 /// Queries the terminal parameters (such as the screen size)
 void CTerminfo::ObtainTerminalParameters (void)
 {
@@ -215,6 +857,12 @@ void CTerminfo::ObtainTerminalParameters (void)
 	    _nRows = ws.ws_row;
 	}
     }
+    // Direct color support is not in the legacy terminfo format, but is advertised by the terminals.
+    _bDirectColor = (sp = getenv ("COLORTERM")) && (!strcmp (sp, "truecolor") || !strcmp (sp, "24bit"));
+    // Expanded tabs would write spaces over the cells they move past
+    if (TtyExpandsTabs (STDOUT_FILENO))
+	_moveCosts[mc_Tab] = 0;
+    _formatCache.clear();
     // Try to fallback to the terminfo entries, or to 80x24.
     if (!_nRows || !_nColumns) {
 	if ((_nRows = GetNumber (ti::lines)) == dim_t(ti::no_value))
@@ -231,21 +879,69 @@ void CTerminfo::ObtainTerminalParameters (void)
 /// Gets boolean value \p i.
 bool CTerminfo::GetBool (ti::EBooleans i) const
 {
-    return size_t(i) < _booleans.size() ? (_booleans[i] > 0) : false;
+    return size_t(i) < _nBooleans ? (_booleans[i] > 0) : false;
 }
 
 /// Gets numeral value \p i.
 CTerminfo::number_t CTerminfo::GetNumber (ti::ENumbers i) const
 {
-    return size_t(i) < _numbers.size() ? _numbers[i] : number_t(ti::no_value);
+    return size_t(i) < _nNumbers ? le_to_native (_numbers[i]) : number_t(ti::no_value);
 }
 
 /// Gets string value \p i.
 CTerminfo::capout_t CTerminfo::GetString (ti::EStrings i) const
 {
-    if (size_t(i) >= _stringOffsets.size() || _stringOffsets[i] == stroffset_t(ti::no_value))
+    if (size_t(i) >= _nStrings)
 	return no_value;
-    return _stringTable.begin() + _stringOffsets[i];
+    const auto o = le_to_native (_stringOffsets[i]);
+    return o < _stringTableSize ? _stringTable + o : no_value;
+}
+
+/// Gets the value of extended string cap \p name, like Sync, or no_value.
+///
+/// Extended caps are found by name in the ncurses extended section that
+/// may follow the standard caps. It is not indexed, so frequently used
+/// values should be looked up once, when the entry is loaded.
+///
+CTerminfo::capout_t CTerminfo::GetExtString (const char* name) const
+{
+    STerminfoHeader h;
+    if (_entry.size() < sizeof(h))
+	return no_value;
+    memcpy (&h, _entry.begin(), sizeof(h));
+    NativeTerminfoHeader (h);
+    // The extended header has counts of booleans, numbers, strings, table items, and the table size
+    size_t o = Align (TerminfoEntrySize (h), sizeof(int16_t));
+    int16_t eh [5];
+    if (o + sizeof(eh) > _entry.size())
+	return no_value;
+    memcpy (eh, _entry.iat (o), sizeof(eh));
+    for (auto& v : eh)
+	if ((v = le_to_native (v)) < 0)
+	    return no_value;
+    // Booleans and numbers are followed by string value offsets, and then name offsets for all three
+    o = Align (o + sizeof(eh) + eh[0], sizeof(int16_t)) + eh[1] * sizeof(int16_t);
+    const size_t nNames = eh[0] + eh[1] + eh[2], tableSize = eh[4];
+    const auto offsets = reinterpret_cast<const int16_t*>(_entry.iat (o));
+    const auto nameOffsets = offsets + eh[2] + eh[0] + eh[1];
+    const size_t tableOffset = o + (eh[2] + nNames) * sizeof(int16_t);
+    if (tableOffset + tableSize > _entry.size())
+	return no_value;
+    const char* table = _entry.iat (tableOffset);
+    auto tableString = [&](size_t so) { return so < tableSize && strnlen (table + so, tableSize - so) < tableSize - so; };
+    // The names follow the string values
+    size_t namesOffset = 0;
+    for (uoff_t i = 0; i < size_t(eh[2]); ++i) {
+	const int16_t so = le_to_native (offsets[i]);
+	if (so >= 0 && tableString (so))
+	    namesOffset = max (namesOffset, so + strlen (table + so) + 1);
+    }
+    for (uoff_t i = 0; i < size_t(eh[2]); ++i) {
+	const int16_t so = le_to_native (offsets[i]), no = le_to_native (nameOffsets[i]);
+	if (no >= 0 && tableString (namesOffset + no) && !strcmp (table + namesOffset + no, name))
+	    return (so >= 0 && tableString (so)) ? table + so : no_value;
+    }
+    return no_value;
 }
 
 /// Pops a value from the program stack.
@@ -265,8 +961,9 @@ void CTerminfo::PSPush (progvalue_t v) const
 }
 
 /// Runs the % opcodes in \p program and appends to \p result.
-void CTerminfo::RunStringProgram (const char* program, string& result, progargs_t args) const
+void CTerminfo::RunStringProgram (const char* program, rstrbuf_t result, progargs_t args) const
 {
+    ++_stats.m_Programs;
     bool bCondValue = false;
     const string prgstr (program);
     foreach (auto, i, prgstr) {
@@ -286,8 +983,13 @@ void CTerminfo::RunStringProgram (const char* program, string& result, progargs_
 	    case '9': if (!base) base = 10;
 		      width = width * base + (*i - '0');
 		      continue;
-	    case '\\': base = 0;			// fallthrough
-	    case '{': continue;				// %{number}
+	    case '\\': base = 0;
+		       continue;
+	    case '{': {					// %{number}
+		char* numEnd;
+		PSPush (strtol (i + 1, &numEnd, 10));
+		i = numEnd;
+		break; }
 	    case '\'': if (*(i - 1) == '%') {		// %'A' or %'\017'
 		          if (*(i + 1) != '\\')
 		 	      width = *++i;
@@ -331,18 +1033,419 @@ void CTerminfo::RunStringProgram (const char* program, string& result, progargs_
     }
 }
 
+//----------------------------------------------------------------------
+// Compiled string programs
+//----------------------------------------------------------------------
+
+/// Opcodes of compiled string programs.
+///
+/// Operands follow the opcode inline. Jump targets are native uint16_t
+/// offsets into _progCode, resolved when the program is compiled.
+///
+enum EProgOp : uint8_t {
+    op_End,
+    op_Text,	///< Count byte, followed by that many literal bytes.
+    op_Param,	///< Parameter index byte.
+    op_Const,	///< Native int32_t constant.
+    op_Inc,
+    op_Dec,	///< %d without flags, width, or precision.
+    op_Char,
+    op_Format,	///< Conversion, flags, width, and precision bytes.
+    op_StrLen,
+    op_Add,
+    op_Sub,
+    op_Mul,
+    op_Div,
+    op_Mod,
+    op_And,
+    op_Or,
+    op_Xor,
+    op_Eq,
+    op_Gt,
+    op_Lt,
+    op_LAnd,
+    op_LOr,
+    op_Not,
+    op_Compl,
+    op_SetVar,	///< Variable index byte.
+    op_GetVar,	///< Variable index byte.
+    op_Jz,	///< Target offset.
+    op_Jmp	///< Target offset.
+};
+
+/// Flags of op_Format.
+enum {
+    pf_Left	= (1 << 0),
+    pf_Plus	= (1 << 1),
+    pf_Space	= (1 << 2),
+    pf_Alt	= (1 << 3),
+    pf_Zero	= (1 << 4)
+};
+
+/// Appends \p v to \p s, formatted as printf conversion \p conv.
+static void AppendNumber (string& s, long v, char conv, uint8_t flags, uint8_t width, uint8_t prec)
+{
+    char buf [32], *const bufend = buf + sizeof(buf), *p = bufend;
+    const bool bSigned = (conv == 'd' || conv == 's'), bNeg = bSigned && v < 0;
+    const unsigned base = conv == 'o' ? 8 : ((conv == 'x' || conv == 'X') ? 16 : 10);
+    const char* digits = conv == 'X' ? "0123456789ABCDEF" : "0123456789abcdef";
+    auto u = bNeg ? -(unsigned long)(v) : (unsigned long)(v);
+    do { *--p = digits[u % base]; } while ((u /= base));
+    while (p > buf + 2 && bufend - p < prec)
+	*--p = '0';
+    if ((flags & pf_Alt) && base == 8 && *p != '0')
+	*--p = '0';
+    char pfx [2];
+    uint8_t npfx = 0;
+    if (bNeg)
+	pfx[npfx++] = '-';
+    else if (bSigned && (flags & pf_Plus))
+	pfx[npfx++] = '+';
+    else if (bSigned && (flags & pf_Space))
+	pfx[npfx++] = ' ';
+    else if ((flags & pf_Alt) && base == 16 && v) {
+	pfx[npfx++] = '0';
+	pfx[npfx++] = conv;
+    }
+    const size_t ndigits = bufend - p, len = npfx + ndigits;
+    const size_t pad = width > len ? width - len : 0;
+    if (!(flags & (pf_Left | pf_Zero)))
+	s.append (pad, ' ');
+    s.append (pfx, npfx);
+    if ((flags & (pf_Left | pf_Zero)) == pf_Zero)
+	s.append (pad, '0');
+    s.append (p, ndigits);
+    if (flags & pf_Left)
+	s.append (pad, ' ');
+}
+
+/// Compiles string cap \p program, appending the bytecode to \p code.
+///
+/// Literal text is merged into runs and conditionals are resolved into
+/// jumps, so the evaluator never needs to rescan the program text.
+///
+/*static*/ void CTerminfo::CompileStringProgram (const char* program, progcode_t& code)
+{
+    struct SCond {
+	uoff_t		jz;		///< Offset of the pending %t jump target, if any.
+	uoff_t		ends [8];	///< Offsets of %e jump targets to patch at %;.
+	uint8_t		nEnds;
+	bool		bHaveJz;
+    } conds [8];
+    uint8_t nConds = 0;
+    auto emitOp = [&code](uint8_t op, size_t operandSize) {
+	code.push_back (op);
+	const uoff_t operand = code.size();
+	code.resize (operand + operandSize);
+	return operand;
+    };
+    auto patchJump = [&code](uoff_t operand) {
+	const uint16_t target = code.size();
+	memcpy (&code[operand], &target, sizeof(target));
+    };
+    bool bInText = false;
+    uoff_t textOp = 0;
+    for (const char* i = program; *i; ++i) {
+	if (*i != '%' || *++i == '%') {	// Literal text, merged into runs of up to 255 bytes.
+	    if (!bInText || code[textOp + 1] == UINT8_MAX) {
+		textOp = emitOp (op_Text, 1) - 1;
+		bInText = true;
+	    }
+	    code.push_back (*i);
+	    ++code[textOp + 1];
+	    continue;
+	}
+	bInText = false;
+	if (!*i)
+	    break;
+	switch (*i) {
+	    case 'p': if (i[1] >= '1' && i[1] <= '9')
+			  code[emitOp (op_Param, 1)] = min (*++i - '1', attr_Last - 1);
+		      break;
+	    case 'P':
+	    case 'g': if (isalpha (i[1])) {
+			  const uint8_t vi = islower (i[1]) ? i[1] - 'a' : i[1] - 'A' + 26;
+			  code[emitOp (*i == 'P' ? op_SetVar : op_GetVar, 1)] = vi;
+			  ++i;
+		      }
+		      break;
+	    case '\'':
+	    case '{': {
+		int32_t v = 0;
+		if (*i == '\'') {
+		    if (!i[1] || !i[2])
+			break;
+		    v = uint8_t(*++i);
+		    ++i;	// the closing quote
+		} else {
+		    const bool bNeg = (i[1] == '-');
+		    for (i += 1 + bNeg; isdigit (*i); ++i)
+			v = v * 10 + (*i - '0');
+		    if (bNeg)
+			v = -v;
+		    if (*i != '}')
+			--i;
+		}
+		memcpy (&code[emitOp (op_Const, sizeof(v))], &v, sizeof(v));
+		break; }
+	    case 'c': code.push_back (op_Char);		break;
+	    case 'l': code.push_back (op_StrLen);	break;
+	    case 'i': code.push_back (op_Inc);		break;
+	    case '+': code.push_back (op_Add);		break;
+	    case '-': code.push_back (op_Sub);		break;
+	    case '*': code.push_back (op_Mul);		break;
+	    case '/': code.push_back (op_Div);		break;
+	    case 'm': code.push_back (op_Mod);		break;
+	    case '&': code.push_back (op_And);		break;
+	    case '|': code.push_back (op_Or);		break;
+	    case '^': code.push_back (op_Xor);		break;
+	    case '=': code.push_back (op_Eq);		break;
+	    case '>': code.push_back (op_Gt);		break;
+	    case '<': code.push_back (op_Lt);		break;
+	    case 'A': code.push_back (op_LAnd);		break;
+	    case 'O': code.push_back (op_LOr);		break;
+	    case '!': code.push_back (op_Not);		break;
+	    case '~': code.push_back (op_Compl);	break;
+	    case '?': if (nConds < VectorSize(conds)) {
+			  conds[nConds].nEnds = 0;
+			  conds[nConds++].bHaveJz = false;
+		      }
+		      break;
+	    case 't': if (nConds) {
+			  auto& c = conds[nConds-1];
+			  c.jz = emitOp (op_Jz, sizeof(uint16_t));
+			  c.bHaveJz = true;
+		      }
+		      break;
+	    case 'e': if (nConds) {		// else or elsif
+			  auto& c = conds[nConds-1];
+			  if (c.nEnds < VectorSize(c.ends))
+			      c.ends[c.nEnds++] = emitOp (op_Jmp, sizeof(uint16_t));
+			  if (c.bHaveJz)
+			      patchJump (c.jz);
+			  c.bHaveJz = false;
+		      }
+		      break;
+	    case ';': if (nConds) {
+			  const auto& c = conds[--nConds];
+			  if (c.bHaveJz)
+			      patchJump (c.jz);
+			  for (uoff_t e = 0; e < c.nEnds; ++e)
+			      patchJump (c.ends[e]);
+		      }
+		      break;
+	    default: {	// %[[:]flags][width[.precision]][doxXs]
+		const bool bColon = (*i == ':');
+		uint8_t flags = 0;
+		unsigned width = 0, prec = 0;
+		for (i += bColon;; ++i) {
+		    if (*i == '#')
+			flags |= pf_Alt;
+		    else if (*i == ' ')
+			flags |= pf_Space;
+		    else if (bColon && *i == '-')
+			flags |= pf_Left;
+		    else if (bColon && *i == '+')
+			flags |= pf_Plus;
+		    else
+			break;
+		}
+		if (*i == '0')
+		    flags |= pf_Zero;
+		for (; isdigit (*i); ++i)
+		    width = min (width * 10 + (*i - '0'), unsigned(UINT8_MAX));
+		if (*i == '.')
+		    for (++i; isdigit (*i); ++i)
+			prec = min (prec * 10 + (*i - '0'), unsigned(UINT8_MAX));
+		if (!*i || !strchr ("doxXs", *i)) {
+		    --i;	// Not a conversion; skip the % and reprocess the rest.
+		    break;
+		}
+		if (*i == 'd' && !flags && !width && !prec) {
+		    code.push_back (op_Dec);
+		    break;
+		}
+		const auto operands = emitOp (op_Format, 4);
+		code[operands] = *i;
+		code[operands + 1] = flags;
+		code[operands + 2] = width;
+		code[operands + 3] = prec;
+		break; }
+	};
+    }
+    while (nConds) {	// Unterminated conditionals end with the program.
+	const auto& c = conds[--nConds];
+	if (c.bHaveJz)
+	    patchJump (c.jz);
+	for (uoff_t e = 0; e < c.nEnds; ++e)
+	    patchJump (c.ends[e]);
+    }
+    code.push_back (op_End);
+}
+
+/// Compiles the string caps in c_ProgramCaps into _progCode.
+void CTerminfo::CompilePrograms (void)
+{
+    _progCode.clear();
+    for (uoff_t i = 0; i < prog_Last; ++i) {
+	_progOffsets[i] = _progCode.size();
+	CompileStringProgram (GetString (c_ProgramCaps[i]), _progCode);
+    }
+}
+
+/// Returns true if \p n bytes of \p code are programs as compiled by CompileStringProgram, starting at \p offsets.
+///
+/// Programs loaded from a cache file are checked with it, so that
+/// RunProgram stays within them and ends: each program must end with
+/// op_End, have its operands within it and in range, and jump only
+/// forward, to an instruction of the same program.
+///
+/*static*/ bool CTerminfo::ValidPrograms (const uint8_t* code, size_t n, const uint16_t* offsets)
+{
+    vector<uint8_t> starts (n + 1, 0);	// 1 at instructions, 2 at the first of a program
+    vector<uint16_t> jumps;		// Targets in the current program
+    for (size_t i = 0, prog = 0; i < n;) {
+	const uint8_t op = code[i];
+	if (op > op_Jmp)
+	    return false;
+	starts[i] = i == prog ? 2 : 1;
+	size_t nOperands = 0;
+	switch (op) {
+	    case op_Text:	nOperands = 1 + (i + 1 < n ? code[i + 1] : 0);	break;
+	    case op_Param:
+	    case op_SetVar:
+	    case op_GetVar:	nOperands = 1;				break;
+	    case op_Const:
+	    case op_Format:	nOperands = 4;				break;
+	    case op_Jz:
+	    case op_Jmp:	nOperands = sizeof(uint16_t);		break;
+	};
+	if (i + 1 + nOperands > n)
+	    return false;
+	if ((op == op_Param && code[i + 1] >= sizeof(progargs_t) / sizeof(number_t))
+		|| ((op == op_SetVar || op == op_GetVar) && code[i + 1] >= sizeof(progvars_t) / sizeof(progvalue_t)))
+	    return false;
+	if (op == op_Jz || op == op_Jmp) {
+	    uint16_t target;
+	    memcpy (&target, &code[i + 1], sizeof(target));
+	    if (target <= i)
+		return false;
+	    jumps.push_back (target);
+	}
+	i += 1 + nOperands;
+	if (op == op_End) {
+	    for (auto t : jumps)
+		if (t >= i || !starts[t])
+		    return false;
+	    jumps.clear();
+	    prog = i;
+	}
+	if (i == n && op != op_End)
+	    return false;
+    }
+    if (!n)
+	return false;
+    for (uoff_t p = 0; p < prog_Last; ++p)
+	if (offsets[p] >= n || starts[offsets[p]] != 2)
+	    return false;
+    return true;
+}
+
+/// Runs compiled program \p p and appends its output to \p result, counting it in the output stats.
+void CTerminfo::RunProgram (EProgram p, rstrbuf_t result, progargs_t args) const
+{
+    if (_progCode.empty())
+	return;
+    ++_stats.m_Programs;
+    ExecProgram (p, result, args);
+}
+
+/// Returns the size of the output of program \p p, without counting it in the output stats.
+size_t CTerminfo::ProgramCost (EProgram p, progargs_t args) const
+{
+    _ctx.scratch.clear();
+    if (!_progCode.empty())
+	ExecProgram (p, _ctx.scratch, args);
+    return _ctx.scratch.size();
+}
+
+/// Interprets compiled program \p p, appending its output to \p result.
+void CTerminfo::ExecProgram (EProgram p, rstrbuf_t result, progargs_t args) const
+{
+    progvalue_t stack [16], a, b;
+    uoff_t sp = 0;
+    auto pop = [&]() { return sp ? stack[--sp] : 0; };
+    auto push = [&](progvalue_t v) { if (sp < VectorSize(stack)) stack[sp++] = v; };
+    const auto code (_progCode.begin());
+    for (auto ip = code + _progOffsets[p];;) {
+	switch (*ip++) {
+	    case op_End:	return;
+	    case op_Text:	result.append (reinterpret_cast<const char*>(ip + 1), *ip);
+				ip += *ip + 1;				break;
+	    case op_Param:	push (args[*ip++]);			break;
+	    case op_Const: {	int32_t v;
+				memcpy (&v, ip, sizeof(v));
+				ip += sizeof(v);
+				push (v);				break; }
+	    case op_Inc:	++args[0]; ++args[1];			break;
+	    case op_Dec:	AppendNumber (result, pop(), 'd', 0, 0, 0);	break;
+	    case op_Char:	result += char(pop());			break;
+	    case op_Format:	AppendNumber (result, pop(), ip[0], ip[1], ip[2], ip[3]);
+				ip += 4;				break;
+	    case op_StrLen:	for (a = pop(), b = 1; a /= 10; ++b) {}
+				push (b);				break;
+	    // Binary operands are popped in reverse order
+	    case op_Add:	b = pop(); a = pop(); push (a + b);	break;
+	    case op_Sub:	b = pop(); a = pop(); push (a - b);	break;
+	    case op_Mul:	b = pop(); a = pop(); push (a * b);	break;
+	    case op_Div:	b = pop(); a = pop(); push (a / (b ? b : 1));	break;
+	    case op_Mod:	b = pop(); a = pop(); push (a % (b ? b : 1));	break;
+	    case op_And:	b = pop(); a = pop(); push (a & b);	break;
+	    case op_Or:		b = pop(); a = pop(); push (a | b);	break;
+	    case op_Xor:	b = pop(); a = pop(); push (a ^ b);	break;
+	    case op_Eq:		b = pop(); a = pop(); push (a == b);	break;
+	    case op_Gt:		b = pop(); a = pop(); push (a > b);	break;
+	    case op_Lt:		b = pop(); a = pop(); push (a < b);	break;
+	    case op_LAnd:	b = pop(); a = pop(); push (a && b);	break;
+	    case op_LOr:	b = pop(); a = pop(); push (a || b);	break;
+	    case op_Not:	push (!pop());				break;
+	    case op_Compl:	push (~pop());				break;
+	    case op_SetVar:	_ctx.progVars[*ip++] = pop();		break;
+	    case op_GetVar:	push (_ctx.progVars[*ip++]);		break;
+	    case op_Jz:		if (pop()) {
+				    ip += sizeof(uint16_t);
+				    break;
+				}				// fallthrough
+	    case op_Jmp: {	uint16_t target;
+				memcpy (&target, ip, sizeof(target));
+				ip = code + target;			break; }
+	};
+    }
+}
+
+/// Runs the program in string cap \p i, precompiled if it is one of c_ProgramCaps.
+void CTerminfo::RunProgram (ti::EStrings i, rstrbuf_t result, progargs_t args) const
+{
+    for (uoff_t p = 0; p < prog_Last; ++p)
+	if (c_ProgramCaps[p] == i)
+	    return RunProgram (EProgram(p), result, args);
+    RunStringProgram (GetString (i), result, args);
+}
+
 /// Replaces \p c with a terminal-specific accelerated value, if available.
 wchar_t CTerminfo::SubstituteChar (wchar_t c) const
 {
-    for (uoff_t i = 0; i < acs_Last; ++i)
-	if (c_AcscInfo[i].m_Unicode == c)
-	    return _acsMap[i];
-    return c;
+    const auto acs = AcsLookup (c);
+    return acs ? wchar_t(acs & ~acsl_Altcharset) : c;
 }
 
 /// Loads terminal strings produced by special keys into \p ksv.
 void CTerminfo::LoadKeystrings (keystrings_t& ksv) const
 {
+    if (_cachedKeymap.size()) {
+	ksv.assign (_cachedKeymap.begin(), _cachedKeymap.size());
+	return;
+    }
     ksv.clear();
     for (uoff_t i = 0; i < VectorSize(c_KeyToStringMap); ++i) {
 	auto ksvp = GetString (ti::EStrings (c_KeyToStringMap [i]));
@@ -365,14 +1468,155 @@ CTerminfo::capout_t CTerminfo::Clear (void) const
     return GetString (ti::clear_screen);
 }
 
+/// Returns true if Scroll can move rows on this terminal.
+bool CTerminfo::CanScroll (void) const
+{
+    auto has = [this](ti::EStrings cap, ti::EStrings parmCap) { return GetString (cap) != no_value || GetString (parmCap) != no_value; };
+    return (GetString (ti::change_scroll_region) != no_value && has (ti::scroll_forward, ti::parm_index) && has (ti::scroll_reverse, ti::parm_rindex))
+	|| (has (ti::delete_line, ti::parm_delete_line) && has (ti::insert_line, ti::parm_insert_line));
+}
+
+/// Appends \p cap \p n times, or \p parmCap with \p n, whichever is available and shorter.
+void CTerminfo::RepeatCap (ti::EStrings cap, ti::EStrings parmCap, dim_t n, rstrbuf_t s) const
+{
+    const auto pcap = GetString (parmCap);
+    if (pcap != no_value && (n > 1 || GetString (cap) == no_value))
+	RunStringProgram (pcap, s, progargs_t (n));
+    else for (dim_t i = 0; i < n; ++i)
+	s += GetString (cap);
+}
+
+/// Moves rows [\p top, \p bottom) up by \p n rows, or down if \p n is negative.
+///
+/// The rows are scrolled with change_scroll_region and scroll_forward or
+/// scroll_reverse, or by deleting and inserting lines, whichever is
+/// shorter. Rows scrolled in are blank in the default colors, matching
+/// what CGC::Scroll does to the screen cache. See CGC::FindScrolls.
+///
+CTerminfo::strout_t CTerminfo::Scroll (coord_t top, coord_t bottom, coord_t n) const
+{
+    assert (CanScroll() && "Scroll requires a terminal for which CanScroll is true");
+    assert (top >= 0 && top < bottom && bottom <= Height() && "The scroll region must be on the screen");
+    _ctx.output.clear();
+    if (!n)
+	return _ctx.output;
+    COutputCount count (*this, out_Other, _ctx.output);
+    Format (0, IndexedColor (lightgray), IndexedColor (black), _ctx.output);
+    const auto codeStart = _ctx.output.size();
+    const auto programsStart = _stats.m_Programs;
+    const dim_t an = min (dim_t(absv (n)), dim_t(bottom - top));
+    const bool bForward = n > 0;
+    const auto csr = GetString (ti::change_scroll_region);
+    if (csr != no_value) {
+	RunStringProgram (csr, _ctx.output, progargs_t (top, bottom - 1));
+	RunProgram (prog_CursorAddress, _ctx.output, progargs_t (bForward ? bottom - 1 : top, 0));
+	if (bForward)
+	    RepeatCap (ti::scroll_forward, ti::parm_index, an, _ctx.output);
+	else
+	    RepeatCap (ti::scroll_reverse, ti::parm_rindex, an, _ctx.output);
+	RunStringProgram (csr, _ctx.output, progargs_t (0, Height() - 1));
+    }
+    if ((GetString (ti::delete_line) != no_value || GetString (ti::parm_delete_line) != no_value)
+	    && (GetString (ti::insert_line) != no_value || GetString (ti::parm_insert_line) != no_value)) {
+	// Lines below the region are moved by the deletion and moved back by the insertion
+	string& s = _ctx.scratch;
+	s.clear();
+	const auto programsCsr = _stats.m_Programs;
+	if (bForward || bottom < Height()) {
+	    RunProgram (prog_CursorAddress, s, progargs_t (bForward ? top : bottom - an, 0));
+	    RepeatCap (ti::delete_line, ti::parm_delete_line, an, s);
+	}
+	if (!bForward || bottom < Height()) {
+	    RunProgram (prog_CursorAddress, s, progargs_t (bForward ? bottom - an : top, 0));
+	    RepeatCap (ti::insert_line, ti::parm_insert_line, an, s);
+	}
+	// Only the programs of the sequence written are counted
+	if (csr == no_value || s.size() < _ctx.output.size() - codeStart) {
+	    _ctx.output.resize (codeStart);
+	    _ctx.output += s;
+	    _stats.m_Programs -= programsCsr - programsStart;
+	} else
+	    _stats.m_Programs = programsCsr;
+    }
+    _ctx.pos[0] = -1;	// Scroll regions home the cursor, and line insertion may move it.
+    _ctx.pos[1] = -1;
+    return _ctx.output;
+}
+
+/// Returns the sequence starting a frame, to be ended with EndFrame.
+///
+/// If the terminal supports synchronized updates (see SyncUpdate), it
+/// holds the display until EndFrame and then paints the frame at once,
+/// without tearing. The cursor is hidden for the duration of the frame.
+///
+CTerminfo::strout_t CTerminfo::BeginFrame (void) const
+{
+    _ctx.output.clear();
+    _ctx.bInFrame = true;
+    _ctx.frameStart = _stats.TotalBytes();
+    COutputCount count (*this, out_Other, _ctx.output);
+    if ((_ctx.bFrameHidCursor = !_ctx.bCursorHidden))
+	_ctx.output += GetString (ti::cursor_invisible);
+    if (_bSyncUpdate)
+	SyncUpdateCode (true, _ctx.output);
+    return _ctx.output;
+}
+
+/// Returns the sequence ending the frame started with BeginFrame.
+CTerminfo::strout_t CTerminfo::EndFrame (void) const
+{
+    _ctx.output.clear();
+    {
+	COutputCount count (*this, out_Other, _ctx.output);
+	if (_bSyncUpdate)
+	    SyncUpdateCode (false, _ctx.output);
+	if (_ctx.bFrameHidCursor)
+	    _ctx.output += GetString (ti::cursor_normal);
+    }
+    _ctx.bFrameHidCursor = false;
+    if (_ctx.bInFrame)
+	CountFrame (_stats.TotalBytes() - _ctx.frameStart);
+    _ctx.bInFrame = false;
+    return _ctx.output;
+}
+
+/// Counts a frame of \p n bytes in _stats.
+void CTerminfo::CountFrame (uint64_t n) const
+{
+    ++_stats.m_Frames;
+    _stats.m_LastFrameBytes = min (n, uint64_t(UINT32_MAX));
+    _stats.m_MaxFrameBytes = max (_stats.m_MaxFrameBytes, _stats.m_LastFrameBytes);
+}
+
+/// Appends the sequence beginning or ending a synchronized update.
+void CTerminfo::SyncUpdateCode (bool bBegin, rstrbuf_t s) const
+{
+    if (_syncCap != no_value)
+	RunStringProgram (_syncCap, s, progargs_t (bBegin ? 1 : 2));
+    else	// Enabled by the probe; the mode is the same everywhere
+	s += bBegin ? "\033[?2026h" : "\033[?2026l";
+}
+
+/// Returns the query for synchronized update support. See CKeyboard::ProbeSyncUpdate.
+///
+/// This is a DECRQM query for mode 2026, followed by a primary device
+/// attributes request, which all terminals answer, to end the wait for
+/// a reply from those that do not know DECRQM.
+///
+CTerminfo::capout_t CTerminfo::SyncUpdateProbe (void)
+{
+    return "\033[?2026$p\033[c";
+}
+
 /// Resets the saved terminal state without doing anything to the terminal.
 void CTerminfo::ResetState (void) const
 {
     _ctx.attrs = 0;
-    _ctx.fg = lightgray;
-    _ctx.bg = black;
-    _ctx.pos[0] = 0;
-    _ctx.pos[1] = 0;
+    _ctx.fg = IndexedColor (lightgray);
+    _ctx.bg = IndexedColor (black);
+    _ctx.pos[0] = -1;	// Unknown, so the next move will be absolute.
+    _ctx.pos[1] = -1;
+    _formatCache.clear();
 }
 
 /// Resets the terminal to a sane state.
@@ -386,8 +1630,8 @@ CTerminfo::capout_t CTerminfo::Reset (void) const
 CTerminfo::capout_t CTerminfo::AllAttrsOff (void) const
 {
     _ctx.attrs = 0;
-    _ctx.fg = lightgray;
-    _ctx.bg = black;
+    _ctx.fg = IndexedColor (lightgray);
+    _ctx.bg = IndexedColor (black);
     return GetString (ti::exit_attribute_mode);
 }
 
@@ -400,11 +1644,189 @@ void CTerminfo::Update (void)
 /// Appends move(x,y) string to s.
 void CTerminfo::MoveTo (coord_t x, coord_t y, rstrbuf_t s) const
 {
-    RunStringProgram (GetString (ti::cursor_address), s, progargs_t(y, x));
+    COutputCount count (*this, out_Motion, s);
+    RunProgram (prog_CursorAddress, s, progargs_t(y, x));
+    _ctx.pos[0] = x;
+    _ctx.pos[1] = y;
+}
+
+/// Appends the cheapest sequence moving the cursor to \p x, \p y to \p s.
+///
+/// The candidates are absolute addressing and relative motion starting
+/// at the current position, carriage return, newline, home, or after an
+/// auto-margin wrap. When the screen contents in _ctx.shown are known,
+/// unchanged cells may also be reprinted instead of moving over them.
+///
+void CTerminfo::MoveCursor (coord_t x, coord_t y, rstrbuf_t s) const
+{
+    const coord_t cx = _ctx.pos[0], cy = _ctx.pos[1];
+    if (x == cx && y == cy)
+	return;
+    COutputCount count (*this, out_Motion, s);
+    const size_t c_Infinite = INT16_MAX;
+    const bool bKnownRow = (cy >= 0 && cy < Height());
+    const bool bKnownPos = bKnownRow && cx >= 0 && cx < Width();
+
+    auto progCost = [&](EProgram p, progargs_t a) {
+	if (GetString (c_ProgramCaps[p]) == no_value)
+	    return c_Infinite;
+	return ProgramCost (p, a);
+    };
+    auto repeatCost = [&](EMoveCap m, coord_t n) {
+	return _moveCosts[m] ? size_t(_moveCosts[m]) * n : c_Infinite;
+    };
+    auto repeat = [&](EMoveCap m, coord_t n) {
+	for (const auto ms = GetString (c_MoveCaps[m]); n > 0; --n)
+	    s += ms;
+    };
+    // Cells [from,to) of row can be reprinted if they would look the same with the current format.
+    auto canReprint = [&](coord_t row, coord_t from, coord_t to) {
+	const auto& r = _ctx.shownArea;
+	if (!_ctx.shown || row < r[0][1] || row >= r[1][1] || from < r[0][0] || to > r[1][0])
+	    return false;
+	const auto rowCells = _ctx.shown + (ptrdiff_t((row - r[0][1]) * r.Width()) - r[0][0]);
+	for (auto i = from; i < to; ++i) {
+	    uint16_t attrs;
+	    color_t fg, bg;
+	    if (!rowCells[i].c)
+		return false;
+	    const wchar_t dc = CellOutput (rowCells[i], attrs, fg, bg);
+	    if (dc > CHAR_MAX || attrs != _ctx.attrs || fg != _ctx.fg || bg != _ctx.bg)
+		return false;
+	}
+	return true;
+    };
+    auto reprint = [&](coord_t row, coord_t from, coord_t to) {
+	const auto& r = _ctx.shownArea;
+	const auto rowCells = _ctx.shown + (ptrdiff_t((row - r[0][1]) * r.Width()) - r[0][0]);
+	uint16_t attrs;
+	color_t fg, bg;
+	for (auto i = from; i < to; ++i)
+	    s += char(CellOutput (rowCells[i], attrs, fg, bg));
+	_stats.m_CellsSent += to - from;
+    };
+    // Vertical motion from row from to y, keeping the column.
+    auto vmove = [&](coord_t from, bool bEmit) {
+	if (from == y)
+	    return size_t(0);
+	const bool bDown = y > from;
+	const coord_t n = bDown ? y - from : from - y;
+	const auto pp = bDown ? prog_ParmDownCursor : prog_ParmUpCursor;
+	const auto mc = bDown ? mc_Down : mc_Up;
+	const size_t ca = progCost (prog_RowAddress, progargs_t (y)),
+		     cp = progCost (pp, progargs_t (n)),
+		     cr = repeatCost (mc, n),
+		     best = min (cr, min (cp, ca));
+	if (!bEmit)
+	    return best;
+	if (best == cr)
+	    repeat (mc, n);
+	else if (best == cp)
+	    RunProgram (pp, s, progargs_t (n));
+	else
+	    RunProgram (prog_RowAddress, s, progargs_t (y));
+	return best;
+    };
+    // Horizontal motion on row y from column from to x.
+    auto hmove = [&](coord_t from, bool bEmit) {
+	if (from == x)
+	    return size_t(0);
+	const bool bRight = x > from;
+	const coord_t n = bRight ? x - from : from - x;
+	const auto pp = bRight ? prog_ParmRightCursor : prog_ParmLeftCursor;
+	const auto mc = bRight ? mc_Right : mc_Left;
+	const size_t ca = progCost (prog_ColumnAddress, progargs_t (x)),
+		     cp = progCost (pp, progargs_t (n)),
+		     cr = repeatCost (mc, n),
+		     cs = (bRight && canReprint (y, from, x)) ? size_t(n) : c_Infinite;
+	// Tabs to the last stop before x, then the rest by reprinting or cuf1.
+	size_t ct = c_Infinite, ctr = 0;
+	coord_t tx = x, nTabs = 0;
+	if (bRight && _moveCosts[mc_Tab] && _tabSize && (tx = x - x % _tabSize) > from) {
+	    nTabs = tx / _tabSize - from / _tabSize;
+	    if (tx < x)
+		ctr = min (repeatCost (mc_Right, x - tx), canReprint (y, tx, x) ? size_t(x - tx) : c_Infinite);
+	    ct = nTabs * _moveCosts[mc_Tab] + ctr;
+	}
+	const size_t best = min (min (cs, cr), min (ct, min (cp, ca)));
+	if (!bEmit)
+	    return best;
+	if (best == cs)
+	    reprint (y, from, x);
+	else if (best == cr)
+	    repeat (mc, n);
+	else if (best == ct) {
+	    repeat (mc_Tab, nTabs);
+	    if (tx < x && ctr == size_t(x - tx) && canReprint (y, tx, x))
+		reprint (y, tx, x);
+	    else
+		repeat (mc_Right, x - tx);
+	} else if (best == cp)
+	    RunProgram (pp, s, progargs_t (n));
+	else
+	    RunProgram (prog_ColumnAddress, s, progargs_t (x));
+	return best;
+    };
+
+    // Find the cheapest starting point for relative motion
+    enum { o_Absolute, o_Current, o_Return, o_Newline, o_Home, o_Wrap } origin = o_Absolute;
+    size_t best = progCost (prog_CursorAddress, progargs_t (y, x));
+    auto tryOrigin = [&](decltype(origin) o, size_t ocost, coord_t ox, coord_t oy) {
+	if (ocost >= best)
+	    return;
+	const size_t c = ocost + vmove (oy, false) + hmove (ox, false);
+	if (c < best) {
+	    best = c;
+	    origin = o;
+	}
+    };
+    if (bKnownPos)
+	tryOrigin (o_Current, 0, cx, cy);
+    if (bKnownRow && _moveCosts[mc_CarriageReturn])
+	tryOrigin (o_Return, _moveCosts[mc_CarriageReturn], 0, cy);
+    if (bKnownRow && y > cy)
+	tryOrigin (o_Newline, y - cy, 0, y);
+    if (_moveCosts[mc_Home])
+	tryOrigin (o_Home, _moveCosts[mc_Home], 0, 0);
+    const bool bCanWrap = bKnownPos && cy + 1 < Height() && GetBool (ti::auto_right_margin) && !GetBool (ti::eat_newline_glitch);
+    if (bCanWrap && canReprint (cy, cx, Width()))
+	tryOrigin (o_Wrap, Width() - cx, 0, cy + 1);
+
+    coord_t ox = 0, oy = 0;
+    switch (origin) {
+	case o_Absolute:	RunProgram (prog_CursorAddress, s, progargs_t (y, x));
+				ox = x; oy = y;				break;
+	case o_Current:		ox = cx; oy = cy;			break;
+	case o_Return:		repeat (mc_CarriageReturn, 1);
+				oy = cy;				break;
+	case o_Newline:		s.append (y - cy, '\n');
+				oy = y;					break;
+	case o_Home:		repeat (mc_Home, 1);			break;
+	case o_Wrap:		reprint (cy, cx, Width());
+				oy = cy + 1;				break;
+    };
+    vmove (oy, true);
+    hmove (ox, true);
     _ctx.pos[0] = x;
     _ctx.pos[1] = y;
 }
 
+/// Updates the cursor position after \p n characters are printed on the current row.
+void CTerminfo::AdvanceCursor (dim_t n) const
+{
+    if ((_ctx.pos[0] += n) < Width())
+	return;
+    if (!GetBool (ti::auto_right_margin))
+	_ctx.pos[0] = Width() - 1;
+    else if (GetBool (ti::eat_newline_glitch))
+	return;	// The wrap is pending until the next character, so only the row is known.
+    else if (_ctx.pos[1] + 1 < Height()) {
+	_ctx.pos[0] = 0;
+	++_ctx.pos[1];
+    } else	// Scrolled the screen
+	_ctx.pos[0] = _ctx.pos[1] = -1;
+}
+
 /// Moves the cursor to \p x, \p y.
 CTerminfo::strout_t CTerminfo::MoveTo (coord_t x, coord_t y) const
 {
@@ -442,20 +1864,121 @@ void CTerminfo::NormalizeColor (EColor& fg, EColor& bg, uint16_t& attrs) const
     }
 }
 
+/// Converts EColor \p c into color_t.
+static color_t ColorValue (EColor c)
+{
+    return c < color_Last ? IndexedColor (c) : colorv_Keep;
+}
+
 /// Sets the color using normalized values (i.e. no attribute setting)
 void CTerminfo::NColor (EColor fg, EColor bg, rstrbuf_t s) const
 {
-    if (_ctx.fg != fg && fg != color_Preserve)
-	RunStringProgram (GetString (ti::set_a_foreground), s, progargs_t(fg));
-    if (_ctx.bg != bg && bg != color_Preserve)
-	RunStringProgram (GetString (ti::set_a_background), s, progargs_t(bg));
-    _ctx.fg = fg;
-    _ctx.bg = bg;
+    StyleColor (ColorValue (fg), ColorValue (bg), s);
+}
+
+/// Returns the RGB value of entry \p i in the xterm 256-color palette.
+static color_t PaletteRGB (uint8_t i)
+{
+    static const color_t c_Basic[16] = {
+	0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd, 0x00cdcd, 0xe5e5e5,
+	0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00, 0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff
+    };
+    static const uint8_t c_CubeLevels[6] = { 0, 95, 135, 175, 215, 255 };
+    if (i < 16)
+	return c_Basic[i];
+    if (i >= 232) {
+	const uint8_t v = 8 + 10 * (i - 232);
+	return RGBColor (v, v, v);
+    }
+    i -= 16;
+    return RGBColor (c_CubeLevels[i / 36], c_CubeLevels[i / 6 % 6], c_CubeLevels[i % 6]);
+}
+
+/// Returns the entry of the first \p nColors of the 256-color palette closest to \p rgb.
+static uint8_t PaletteIndex (color_t rgb, unsigned nColors)
+{
+    auto distance = [](color_t a, color_t b) {
+	unsigned d = 0;
+	for (unsigned shift = 0; shift < 24; shift += 8) {
+	    const int cd = int((a >> shift) & UINT8_MAX) - int((b >> shift) & UINT8_MAX);
+	    d += cd * cd;
+	}
+	return d;
+    };
+    if (nColors >= 256) {
+	// Only the nearest cube and gray entries need checking
+	auto cubeLevel = [](unsigned v) { return v < 48 ? 0u : (v < 115 ? 1u : (v - 35) / 40); };
+	const unsigned r = (rgb >> 16) & UINT8_MAX, g = (rgb >> 8) & UINT8_MAX, b = rgb & UINT8_MAX;
+	const uint8_t cube = 16 + 36 * cubeLevel (r) + 6 * cubeLevel (g) + cubeLevel (b);
+	const unsigned gray = (r + g + b) / 3;
+	const uint8_t grayi = gray < 8 ? 232 : (gray > 238 ? 255 : 232 + (gray - 3) / 10);
+	return distance (rgb, PaletteRGB (grayi)) < distance (rgb, PaletteRGB (cube)) ? grayi : cube;
+    }
+    uint8_t best = 0;
+    for (unsigned i = 1; i < min (nColors, 16u); ++i)
+	if (distance (rgb, PaletteRGB (i)) < distance (rgb, PaletteRGB (best)))
+	    best = i;
+    return best;
+}
+
+/// Appends the sequence selecting color \p c, reduced to what the terminal supports.
+void CTerminfo::ColorCode (color_t c, bool bBackground, rstrbuf_t s) const
+{
+    c = TerminalColor (c);
+    if (!(c & colorv_Indexed)) {	// 24-bit RGB
+	s += bBackground ? "\033[48;2;" : "\033[38;2;";
+	AppendNumber (s, (c >> 16) & UINT8_MAX, 'd', 0, 0, 0);
+	s += ';';
+	AppendNumber (s, (c >> 8) & UINT8_MAX, 'd', 0, 0, 0);
+	s += ';';
+	AppendNumber (s, c & UINT8_MAX, 'd', 0, 0, 0);
+	s += 'm';
+	return;
+    }
+    RunProgram (bBackground ? prog_SetBackground : prog_SetForeground, s, progargs_t (c & UINT8_MAX));
+}
+
+/// Returns the color the terminal can show for \p c, the nearest one if it has too few.
+color_t CTerminfo::TerminalColor (color_t c) const
+{
+    if (c == colorv_Default || c == colorv_Keep || (!(c & colorv_Indexed) && _bDirectColor))
+	return c;
+    if (!(c & colorv_Indexed))
+	return IndexedColor (PaletteIndex (c, _nColors));
+    if ((c & UINT8_MAX) >= _nColors)
+	return IndexedColor (PaletteIndex (PaletteRGB (c & UINT8_MAX), _nColors));
+    return c;
+}
+
+/// Sets the color to \p fg on \p bg, in any color_t form.
+void CTerminfo::StyleColor (color_t fg, color_t bg, rstrbuf_t s) const
+{
+    COutputCount count (*this, out_Format, s);
+    if ((fg == colorv_Default && _ctx.fg != fg) || (bg == colorv_Default && _ctx.bg != bg)) {
+	const auto op = GetString (ti::orig_pair);
+	if (op != no_value) {
+	    s += op;
+	    _ctx.fg = _ctx.bg = colorv_Default;
+	}
+    }
+    if (fg == colorv_Default && _ctx.fg != fg)	// No orig_pair, so use what it usually is
+	fg = IndexedColor (lightgray);
+    if (bg == colorv_Default && _ctx.bg != bg)
+	bg = IndexedColor (black);
+    if (fg != colorv_Keep && fg != _ctx.fg) {
+	ColorCode (fg, false, s);
+	_ctx.fg = fg;
+    }
+    if (bg != colorv_Keep && bg != _ctx.bg) {
+	ColorCode (bg, true, s);
+	_ctx.bg = bg;
+    }
 }
 
 /// Sets the color to \p fg on \p bg, appending result to \p s.
 void CTerminfo::Color (EColor fg, EColor bg, rstrbuf_t s) const
 {
+    COutputCount count (*this, out_Format, s);
     auto newAttrs = _ctx.attrs;
     NormalizeColor (fg, bg, newAttrs);
     if (_ctx.attrs != newAttrs)
@@ -516,6 +2039,7 @@ void CTerminfo::Attrs (uint16_t a, rstrbuf_t s) const
 {
     if (_ctx.attrs == a)
 	return;
+    COutputCount count (*this, out_Format, s);
     const auto sgr = GetString (ti::set_attributes);
     if (sgr == no_value) {
 	size_t nToOff = 0, nToOn = 0;
@@ -528,8 +2052,8 @@ void CTerminfo::Attrs (uint16_t a, rstrbuf_t s) const
 	if (nToOff) {
 	    s += GetString (ti::exit_attribute_mode);
 	    s += GetString (ti::exit_alt_charset_mode);
-	    _ctx.fg = lightgray;
-	    _ctx.bg = black;
+	    _ctx.fg = IndexedColor (lightgray);
+	    _ctx.bg = IndexedColor (black);
 	}
 	mask = 1;
 	for (uoff_t i = 0; i < attr_Last; ++i, mask <<= 1)
@@ -539,13 +2063,76 @@ void CTerminfo::Attrs (uint16_t a, rstrbuf_t s) const
 	progargs_t pa;
 	for (uoff_t i = 0; i < pa.size(); ++i)
 	    pa[i] = (a >> i) & 1;
-	RunStringProgram (sgr, s, pa);
-	_ctx.fg = lightgray;
-	_ctx.bg = black;
+	RunProgram (prog_SetAttributes, s, pa);
+	_ctx.fg = IndexedColor (lightgray);
+	_ctx.bg = IndexedColor (black);
     }
     _ctx.attrs = a;
 }
 
+/// Sets the format to \p attrs and colors \p fg on \p bg, as Attrs and StyleColor do.
+///
+/// The written sequence depends only on the current format and the new
+/// one, so it is generated once for each such pair and then copied from
+/// _formatCache. The cache is direct-mapped by a hash of the pair; an
+/// entry is replaced by any colliding pair.
+///
+void CTerminfo::Format (uint16_t attrs, color_t fg, color_t bg, rstrbuf_t s) const
+{
+    if (attrs == _ctx.attrs && (fg == colorv_Keep || fg == _ctx.fg) && (bg == colorv_Keep || bg == _ctx.bg))
+	return;
+    COutputCount count (*this, out_Format, s);
+    if (_formatCache.empty()) {
+	SFormatChange unused;
+	unused.m_ToAttrs = UINT16_MAX;
+	_formatCache.assign (fcache_Size, unused);
+    }
+    const uint32_t c_FnvPrime = 0x01000193;
+    uint32_t h = (uint32_t(_ctx.attrs) << 16) | attrs;
+    h = (h ^ _ctx.fg) * c_FnvPrime;
+    h = (h ^ _ctx.bg) * c_FnvPrime;
+    h = (h ^ fg) * c_FnvPrime;
+    h = (h ^ bg) * c_FnvPrime;
+    auto& e = _formatCache [(h ^ (h >> 16)) % fcache_Size];
+    ++_nFormatLookups;
+    if (e.m_ToAttrs == attrs && e.m_FromAttrs == _ctx.attrs && e.m_FromFg == _ctx.fg && e.m_FromBg == _ctx.bg && e.m_ToFg == fg && e.m_ToBg == bg) {
+	++_nFormatHits;
+	s.append (e.m_Code, e.m_CodeSize);
+	_ctx.attrs = attrs;
+	_ctx.fg = e.m_ResultFg;
+	_ctx.bg = e.m_ResultBg;
+	return;
+    }
+    SFormatChange change;
+    change.m_FromFg = _ctx.fg;
+    change.m_FromBg = _ctx.bg;
+    change.m_FromAttrs = _ctx.attrs;
+    const auto codeStart = s.size();
+    Attrs (attrs, s);
+    StyleColor (fg, bg, s);
+    const size_t codeSize = s.size() - codeStart;
+    if (codeSize > fcache_MaxCode)
+	return;
+    change.m_ToAttrs = attrs;
+    change.m_ToFg = fg;
+    change.m_ToBg = bg;
+    change.m_ResultFg = _ctx.fg;
+    change.m_ResultBg = _ctx.bg;
+    change.m_CodeSize = codeSize;
+    copy_n (s.iat (codeStart), codeSize, change.m_Code);
+    e = change;
+}
+
+/// Returns the fraction of format changes written by Image that were cached.
+///
+/// The cache is emptied by ResetState and by loading a terminfo entry,
+/// which also restarts the count.
+///
+float CTerminfo::FormatCacheHitRate (void) const
+{
+    return _nFormatLookups ? float(_nFormatHits) / _nFormatLookups : 0.f;
+}
+
 /// Sets all attributes to values in \p a (masked by EAttribute)
 CTerminfo::strout_t CTerminfo::Attrs (uint16_t a) const
 {
@@ -558,6 +2145,8 @@ CTerminfo::strout_t CTerminfo::Attrs (uint16_t a) const
 CTerminfo::strout_t CTerminfo::Box (coord_t x, coord_t y, dim_t w, dim_t h) const
 {
     _ctx.output = AttrOn (a_altcharset);
+    _stats.m_Bytes[out_Format] += _ctx.output.size();
+    COutputCount count (*this, out_Text, _ctx.output);
     MoveTo (x, y, _ctx.output);
 
     _ctx.output += AcsChar (acs_UpperLeftCorner);
@@ -575,6 +2164,8 @@ CTerminfo::strout_t CTerminfo::Box (coord_t x, coord_t y, dim_t w, dim_t h) cons
     _ctx.output += AcsChar (acs_LowerLeftCorner);
     fill_n (back_inserter(_ctx.output), w - 2, AcsChar (acs_HLine));
     _ctx.output += AcsChar (acs_LowerRightCorner);
+    _ctx.pos[0] = x + w - 1;
+    AdvanceCursor();
 
     Attrs ((_ctx.attrs & ~(1 << a_altcharset)), _ctx.output);
     return _ctx.output;
@@ -584,9 +2175,13 @@ CTerminfo::strout_t CTerminfo::Box (coord_t x, coord_t y, dim_t w, dim_t h) cons
 CTerminfo::strout_t CTerminfo::Bar (coord_t x, coord_t y, dim_t w, dim_t h, char c) const
 {
     _ctx.output = AttrOn (a_altcharset);
+    _stats.m_Bytes[out_Format] += _ctx.output.size();
+    COutputCount count (*this, out_Text, _ctx.output);
     for (dim_t yi = 0; yi < h; ++yi) {
 	MoveTo (x, y + yi, _ctx.output);
 	fill_n (back_inserter(_ctx.output), w, c);
+	_ctx.pos[0] = x + w - 1;
+	AdvanceCursor();
     }
     Attrs ((_ctx.attrs & ~(1 << a_altcharset)), _ctx.output);
     return _ctx.output;
@@ -604,49 +2199,416 @@ CTerminfo::strout_t CTerminfo::VLine (coord_t x, coord_t y, dim_t h) const
     return Bar (x, y, 1, h, AcsChar(acs_VLine));
 }
 
+/// Copies the characters of the leading cells of [\p first, \p last) that are printable ASCII in \p format into \p out.
+///
+/// Returns the number of cells copied. The cells are checked and narrowed
+/// eight at a time with AVX2 and four at a time with SSE2.
+///
+static size_t PackAsciiRun (const CCharCell* first, const CCharCell* last, uint32_t format, char* out)
+{
+    const CCharCell* i = first;
+    if (i >= last)
+	return 0;
+#if __AVX2__
+    const __m256i fmt8 = _mm256_set1_epi32 (format), lo8 = _mm256_set1_epi32 (' ' - 1), hi8 = _mm256_set1_epi32 (0x7f);
+    for (; last - i >= 8; i += 8, out += 8) {
+	// Cells 0,1,2,3 and 4,5,6,7, separated into chars and formats
+	const __m256 a = _mm256_loadu_ps (reinterpret_cast<const float*>(i)), b = _mm256_loadu_ps (reinterpret_cast<const float*>(i + 4));
+	const __m256i c = _mm256_permute4x64_epi64 (_mm256_castps_si256 (_mm256_shuffle_ps (a, b, _MM_SHUFFLE(2,0,2,0))), _MM_SHUFFLE(3,1,2,0));
+	const __m256i f = _mm256_castps_si256 (_mm256_shuffle_ps (a, b, _MM_SHUFFLE(3,1,3,1)));	// Order does not matter
+	const __m256i ok = _mm256_and_si256 (_mm256_cmpeq_epi32 (f, fmt8), _mm256_and_si256 (_mm256_cmpgt_epi32 (c, lo8), _mm256_cmpgt_epi32 (hi8, c)));
+	if (_mm256_movemask_ps (_mm256_castsi256_ps (ok)) != 0xff)
+	    break;
+	const __m128i c16 = _mm_packs_epi32 (_mm256_castsi256_si128 (c), _mm256_extracti128_si256 (c, 1));
+	_mm_storel_epi64 (reinterpret_cast<__m128i*>(out), _mm_packus_epi16 (c16, c16));
+    }
+#endif
+#if __SSE2__
+    const __m128i fmt4 = _mm_set1_epi32 (format), lo4 = _mm_set1_epi32 (' ' - 1), hi4 = _mm_set1_epi32 (0x7f);
+    for (; last - i >= 4; i += 4, out += 4) {
+	const __m128 a = _mm_loadu_ps (reinterpret_cast<const float*>(i)), b = _mm_loadu_ps (reinterpret_cast<const float*>(i + 2));
+	const __m128i c = _mm_castps_si128 (_mm_shuffle_ps (a, b, _MM_SHUFFLE(2,0,2,0)));
+	const __m128i f = _mm_castps_si128 (_mm_shuffle_ps (a, b, _MM_SHUFFLE(3,1,3,1)));
+	const __m128i ok = _mm_and_si128 (_mm_cmpeq_epi32 (f, fmt4), _mm_and_si128 (_mm_cmpgt_epi32 (c, lo4), _mm_cmplt_epi32 (c, hi4)));
+	if (_mm_movemask_ps (_mm_castsi128_ps (ok)) != 0xf)
+	    break;
+	const __m128i c16 = _mm_packs_epi32 (c, c);
+	const int c8 = _mm_cvtsi128_si32 (_mm_packus_epi16 (c16, c16));
+	memcpy (out, &c8, sizeof(c8));
+    }
+#endif
+    for (uint32_t f; i < last; ++i, ++out) {
+	memcpy (&f, &i->fg, sizeof(f));
+	if (f != format || i->c < ' ' || i->c >= 0x7f)
+	    break;
+	*out = char(i->c);
+    }
+    return i - first;
+}
+
+/// Writes \p c to \p out in UTF-8 and returns the end of the written bytes.
+static char* EncodeUtf8 (wchar_t c, char* out)
+{
+    const uint32_t v = c;
+    if (v < 0x80)
+	*out++ = v;
+    else {
+	const unsigned n = 1 + (v >= 0x800) + (v >= 0x10000);
+	*out++ = uint8_t(0xff80 >> n) | (v >> (6 * n));
+	for (unsigned i = n; i--;)
+	    *out++ = 0x80 | ((v >> (6 * i)) & 0x3f);
+    }
+    return out;
+}
+
+/// Returns true if \p c is a printable Unicode character one column wide, that can be written in UTF-8.
+///
+/// Cells are one column each, so combining and zero-width characters,
+/// and East Asian wide ones, would move the cursor elsewhere than where
+/// the next cell is expected. The ranges of those are built in, rather
+/// than asked of wcwidth, which depends on the program's setlocale call.
+///
+static bool IsPrintableUnicode (wchar_t c)
+{
+    static const struct { uint32_t first, last; } c_NotSingleWidth[] = {
+	{ 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd }, { 0x0610, 0x061a },
+	{ 0x064b, 0x065f }, { 0x1100, 0x115f }, { 0x1ab0, 0x1aff }, { 0x1dc0, 0x1dff },
+	{ 0x200b, 0x200f }, { 0x2028, 0x202e }, { 0x2060, 0x206f }, { 0x20d0, 0x20ff },
+	{ 0x231a, 0x231b }, { 0x2329, 0x232a }, { 0x2e80, 0x303e }, { 0x3041, 0x33ff },
+	{ 0x3400, 0x4dbf }, { 0x4e00, 0x9fff }, { 0xa000, 0xa4cf }, { 0xa960, 0xa97f },
+	{ 0xac00, 0xd7a3 }, { 0xf900, 0xfaff }, { 0xfe00, 0xfe0f }, { 0xfe10, 0xfe19 },
+	{ 0xfe20, 0xfe6f }, { 0xfeff, 0xfeff }, { 0xff00, 0xff60 }, { 0xffe0, 0xffe6 },
+	{ 0x1f300, 0x1f64f }, { 0x1f900, 0x1f9ff }, { 0x20000, 0x2fffd }, { 0x30000, 0x3fffd },
+	{ 0xe0001, 0xe01ef }
+    };
+    const uint32_t v = c;
+    if (v >= ' ' && v < 0x7f)
+	return true;
+    if (v < 0xa0 || v >= 0x110000 || (v >= 0xd800 && v < 0xe000))
+	return false;
+    const auto end = c_NotSingleWidth + VectorSize (c_NotSingleWidth);
+    const auto r = upper_bound (c_NotSingleWidth, end, v, [](uint32_t x, const auto& range) { return x < range.first; });
+    return r == c_NotSingleWidth || v > r[-1].last;
+}
+
+/// Converts \p cell into the printed character and its attributes, with a_altcharset set if needed.
+wchar_t CTerminfo::CellChar (const CCharCell& cell, uint16_t& attrs) const
+{
+    wchar_t dc = cell.c;
+    attrs = cell.attrs & BitMask(uint16_t,attr_Last);
+    if (_bUtf8) {	// Unicode characters are written directly, without ACS
+	if (!(attrs & (1 << a_altcharset)) && !IsPrintableUnicode (dc))
+	    dc = ' ';
+	return dc;
+    }
+    if (dc > CHAR_MAX) {
+	const auto acs = AcsLookup (dc);
+	if (acs)
+	    dc = acs & ~acsl_Altcharset;
+	if (!acs || (acs & acsl_Altcharset))
+	    attrs |= (1 << a_altcharset);
+    }
+    if (!(attrs & (1 << a_altcharset)) && !isprint(dc))
+	dc = ' ';
+    return dc;
+}
+
+/// Returns the first run of c_MinRepeat or more equal cells in [first, last), or last; sets \p n to its length.
+static const CCharCell* FindRepeat (const CCharCell* first, const CCharCell* last, size_t& n)
+{
+    const size_t c_MinRepeat = 4;	// Shortest run that a cap can write in fewer bytes
+    for (auto i = first; i < last;) {
+	auto j = i + 1;
+	while (j < last && *j == *i)
+	    ++j;
+	if (i->c && size_t(j - i) >= c_MinRepeat) {
+	    n = j - i;
+	    return i;
+	}
+	i = j;
+    }
+    n = 0;
+    return last;
+}
+
+/// Writes \p n cells of \p dc in the current format with a cap, if shorter than writing them.
+///
+/// Blanks can be erased, with clr_eol if \p bToEol says the cells end
+/// the screen row, or with erase_chars. Erased cells have no attributes,
+/// and the current background only with back_color_erase. Other cells
+/// can be written with repeat_char. Returns false if nothing is shorter.
+///
+bool CTerminfo::RepeatCells (wchar_t dc, dim_t n, bool bToEol, rstrbuf_t s) const
+{
+    if (dc > CHAR_MAX)
+	return false;
+    COutputCount count (*this, out_Erase, s);
+    const bool bErasable = dc == ' ' && !_ctx.attrs
+	&& (GetBool (ti::back_color_erase) || _ctx.bg == IndexedColor (black) || _ctx.bg == colorv_Default);
+    const auto el = GetString (ti::clr_eol);
+    if (bErasable && bToEol && el != no_value && strlen (el) < n) {
+	s += el;
+	_ctx.pos[0] = -1;	// Only the row is known, so the erased cells, still in _ctx.shown, are not reprinted
+	return true;
+    }
+    // Costed first, so that only the programs written are counted
+    size_t ce = SIZE_MAX, cr = SIZE_MAX;
+    if (bErasable && !bToEol && GetString (ti::erase_chars) != no_value && GetString (ti::parm_right_cursor) != no_value)
+	ce = ProgramCost (prog_EraseChars, progargs_t (n)) + ProgramCost (prog_ParmRightCursor, progargs_t (n));
+    if (GetString (ti::repeat_char) != no_value)
+	cr = ProgramCost (prog_RepeatChar, progargs_t (dc, n));
+    if (min (ce, cr) >= n)
+	return false;
+    if (cr < ce)
+	RunProgram (prog_RepeatChar, s, progargs_t (dc, n));
+    else {
+	RunProgram (prog_EraseChars, s, progargs_t (n));
+	RunProgram (prog_ParmRightCursor, s, progargs_t (n));	// ech does not move the cursor
+    }
+    AdvanceCursor (n);
+    return true;
+}
+
+/// Sets \p fg and \p bg to the colors of \p cell, normalizing \p attrs for EColor colors.
+///
+/// A styled cell drawn without its style table is shown in lightgray on
+/// black, since its fg and bg hold a style index rather than colors.
+///
+void CTerminfo::CellFormat (const CCharCell& cell, uint16_t& attrs, color_t& fg, color_t& bg) const
+{
+    if (cell.IsStyled() && _ctx.styles) {
+	const auto& style = _ctx.styles [cell.StyleIndex()];
+	fg = style.fg;
+	bg = style.bg;
+	return;
+    }
+    assert (!cell.IsStyled() && "Styled cells must be drawn with their style table");
+    EColor efg (EColor(cell.fg)), ebg (EColor(cell.bg));
+    if (cell.IsStyled()) {
+	efg = lightgray;
+	ebg = black;
+    }
+    NormalizeColor (efg, ebg, attrs);
+    fg = ColorValue (efg);
+    bg = ColorValue (ebg);
+}
+
+/// Converts \p cell into the character and normalized attributes printed by Image.
+wchar_t CTerminfo::CellOutput (const CCharCell& cell, uint16_t& attrs, color_t& fg, color_t& bg) const
+{
+    const wchar_t dc = CellChar (cell, attrs);
+    CellFormat (cell, attrs, fg, bg);
+    return dc;
+}
+
+/// Returns the character and format Image writes for \p cell, with style table \p styles.
+///
+/// Colors are those the terminal shows, after reduction to its palette.
+///
+wchar_t CTerminfo::CellRendition (const CCharCell& cell, const SCellStyle* styles, uint16_t& attrs, color_t& fg, color_t& bg) const
+{
+    const auto oldStyles = _ctx.styles;
+    _ctx.styles = styles;
+    const wchar_t dc = CellOutput (cell, attrs, fg, bg);
+    _ctx.styles = oldStyles;
+    fg = TerminalColor (fg);
+    bg = TerminalColor (bg);
+    return dc;
+}
+
 /// Draws character \p data into the given box. 0-valued characters are transparent.
-CTerminfo::strout_t CTerminfo::Image (coord_t x, coord_t y, dim_t w, dim_t h, const CCharCell* data) const
+///
+/// In UTF-8 mode (see SetUtf8) Unicode characters are written directly,
+/// instead of being substituted with ACS characters.
+///
+/// If the current contents of the box are given in \p shown, unchanged
+/// cells may be reprinted when that is shorter than moving the cursor.
+///
+/// Cells drawn with CGC::Style, in \p data or \p shown, require the CGC
+/// style table in \p styles.
+///
+CTerminfo::strout_t CTerminfo::Image (coord_t x, coord_t y, dim_t w, dim_t h, const CCharCell* data, const CCharCell* shown, const SCellStyle* styles) const
 {
     assert (data && "Image should only be called with valid data");
     assert (x >= 0 && y >= 0 && x + w <= Width() && y + h <= Height() && "Clip the image data before passing it in. CGC::Clip can do it.");
 
     const auto oldAttrs (_ctx.attrs);
-    const auto oldFg (EColor(_ctx.fg)), oldBg (EColor(_ctx.bg));
+    const auto oldFg (_ctx.fg), oldBg (_ctx.bg);
+    ImageStart (shown, gdt::Rect (x, y, w, h), styles);
+    {
+	COutputCount count (*this, out_Text, _ctx.output);
+	for (coord_t j = y; j < y + h; ++j, data += w)
+	    ImageCells (x, j, data, data + w);
+    }
+    return ImageEnd (oldAttrs, oldFg, oldBg);
+}
 
-    _ctx.output = GetString(ti::ena_acs);
-    for (coord_t j = y; j < y + h; ++j) {
-	for (coord_t i = x; i < x + w; ++i, ++data) {
-	    wchar_t dc = data->c;
-	    if (!dc)
-		continue;
-	    if (i != _ctx.pos[0] || j != _ctx.pos[1]) {
-		if (i == 0 && j == _ctx.pos[1] + 1) {
-		    _ctx.output += '\n';
-		    _ctx.pos[0] = 0;
-		    ++_ctx.pos[1];
-		} else
-		    MoveTo (i, j, _ctx.output);
-	    }
-	    uint16_t dattr (data->attrs & BitMask(uint16_t,attr_Last));
-	    if (dc > CHAR_MAX) {
-		dc = SubstituteChar(dc);
-		dattr |= (1 << a_altcharset);
+/// Draws the cells in \p spans of a \p w by \p h canvas \p data.
+///
+/// Like Image of the whole canvas, with all cells outside \p spans zero,
+/// but those cells are not looked at. The spans, as made by
+/// CGC::MakeDiffFrom, are ordered by row and column and do not overlap.
+/// \p shown, if given, is the canvas the terminal shows, of the same size.
+///
+CTerminfo::strout_t CTerminfo::Image (const gdt::spans_t& spans, dim_t w, dim_t h, const CCharCell* data, const CCharCell* shown, const SCellStyle* styles) const
+{
+    assert (data && "Image should only be called with valid data");
+    assert (w <= Width() && h <= Height() && "Clip the image data before passing it in. CGC::Clip can do it.");
+
+    const auto oldAttrs (_ctx.attrs);
+    const auto oldFg (_ctx.fg), oldBg (_ctx.bg);
+    ImageStart (shown, gdt::Rect (0, 0, w, h), styles);
+    {
+	COutputCount count (*this, out_Text, _ctx.output);
+	for (const auto& s : spans) {
+	    assert (s.y < h && s.first <= s.last && s.last <= w && "Spans must be on the canvas");
+	    const CCharCell* row = data + s.y * w;
+	    ImageCells (s.first, s.y, row + s.first, row + s.last);
+	}
+    }
+    return ImageEnd (oldAttrs, oldFg, oldBg);
+}
+
+/// Writes cells with characters \p c and formats \p f, \p n of each, to \p out. SSE2 does four at a time.
+static void InterleaveCells (const wchar_t* c, const uint32_t* f, size_t n, CCharCell* out)
+{
+    size_t i = 0;
+#if __SSE2__
+    for (; i + 4 <= n; i += 4) {
+	const __m128i cv = _mm_loadu_si128 (reinterpret_cast<const __m128i*>(c + i)), fv = _mm_loadu_si128 (reinterpret_cast<const __m128i*>(f + i));
+	_mm_storeu_si128 (reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi32 (cv, fv));
+	_mm_storeu_si128 (reinterpret_cast<__m128i*>(out + i + 2), _mm_unpackhi_epi32 (cv, fv));
+    }
+#endif
+    for (; i < n; ++i) {
+	out[i].c = c[i];
+	out[i].SetFormat (f[i]);
+    }
+}
+
+/// Draws the cells in \p spans of a \p w by \p h canvas stored as planes of \p chars and \p formats.
+///
+/// Like the Image overload taking cells, for a CGC with layout_Planes.
+/// Only the cells of the spans are made into whole cells for writing,
+/// and of the shown planes, if given, the rows with spans, for reprinting
+/// unchanged cells on them.
+///
+CTerminfo::strout_t CTerminfo::Image (const gdt::spans_t& spans, dim_t w, dim_t h, const wchar_t* chars, const uint32_t* formats, const wchar_t* shownChars, const uint32_t* shownFormats, const SCellStyle* styles) const
+{
+    assert (chars && formats && "Image should only be called with valid data");
+    assert (w <= Width() && h <= Height() && "Clip the image data before passing it in. CGC::Clip can do it.");
+    assert (!shownChars == !shownFormats && "Shown planes must be given together");
+
+    const auto oldAttrs (_ctx.attrs);
+    const auto oldFg (_ctx.fg), oldBg (_ctx.bg);
+    ImageStart (nullptr, gdt::Rect (0, 0, w, h), styles);
+    {
+	COutputCount count (*this, out_Text, _ctx.output);
+	coord_t shownRow = -1;
+	for (const auto& s : spans) {
+	    assert (s.y < h && s.first <= s.last && s.last <= w && "Spans must be on the canvas");
+	    const size_t row = s.y * w, n = s.last - s.first;
+	    if (shownChars && s.y != shownRow) {
+		_ctx.shownCells.resize (w);
+		InterleaveCells (shownChars + row, shownFormats + row, w, _ctx.shownCells.begin());
+		_ctx.shown = _ctx.shownCells.begin();
+		_ctx.shownArea = gdt::Rect (0, s.y, w, 1);
+		shownRow = s.y;
 	    }
-	    if (!(dattr & (1 << a_altcharset)) && !isprint(dc))
-		dc = ' ';
-	    auto fg (EColor(data->fg)), bg (EColor(data->bg));
-	    NormalizeColor (fg, bg, dattr);
-	    Attrs (dattr, _ctx.output);
-	    NColor (fg, bg, _ctx.output);
-	    _ctx.output += char(dc);
-	    ++_ctx.pos[0];
+	    _ctx.cells.resize (n);
+	    InterleaveCells (chars + row + s.first, formats + row + s.first, n, _ctx.cells.begin());
+	    ImageCells (s.first, s.y, _ctx.cells.begin(), _ctx.cells.end());
 	}
     }
-    Attrs (oldAttrs, _ctx.output);
-    NColor (oldFg, oldBg, _ctx.output);
+    return ImageEnd (oldAttrs, oldFg, oldBg);
+}
+
+/// Starts Image output, with the cells in \p shownArea shown as \p shown.
+void CTerminfo::ImageStart (const CCharCell* shown, const gdt::Rect& shownArea, const SCellStyle* styles) const
+{
+    _ctx.shown = shown;
+    _ctx.styles = styles;
+    _ctx.shownArea = shownArea;
+    _ctx.output = _bUtf8 ? "" : GetString(ti::ena_acs);
+    _stats.m_Bytes[out_Other] += _ctx.output.size();
+}
+
+/// Ends Image output, restoring format \p attrs, \p fg, \p bg, and returns it.
+CTerminfo::strout_t CTerminfo::ImageEnd (uint16_t attrs, color_t fg, color_t bg) const
+{
+    _ctx.shown = nullptr;
+    _ctx.styles = nullptr;
+    Format (attrs, fg, bg, _ctx.output);
+    if (!_ctx.bInFrame)
+	CountFrame (_ctx.output.size());
     return _ctx.output;
 }
 
+/// Draws cells [\p data, \p dataEnd) of row \p y starting at column \p x. 0-valued cells are skipped.
+void CTerminfo::ImageCells (coord_t x, coord_t y, const CCharCell* data, const CCharCell* dataEnd) const
+{
+    const bool bEndsRow = x + (dataEnd - data) == Width();
+    size_t repN;
+    const CCharCell* rep = FindRepeat (data, dataEnd, repN);
+    for (coord_t i = x; data < dataEnd;) {
+	if (!data->c) {
+	    ++i;
+	    ++data;
+	    continue;
+	}
+	MoveCursor (i, y, _ctx.output);
+
+	// The format is set once for the run of cells that share it
+	const CCharCell& runCell = *data;
+	uint16_t runAttrs, dattr;
+	wchar_t dc = CellChar (runCell, runAttrs);
+	color_t fg, bg;
+	CellFormat (runCell, dattr = runAttrs, fg, bg);
+	Format (dattr, fg, bg, _ctx.output);
+
+	// Runs of equal cells may be erased or repeated with a cap
+	if (data == rep) {
+	    const dim_t n = repN;
+	    rep = FindRepeat (data + n, dataEnd, repN);
+	    if (RepeatCells (dc, n, data + n == dataEnd && bEndsRow, _ctx.output)) {
+		data += n;
+		i += n;
+		_stats.m_CellsChanged += n;
+		continue;
+	    }
+	}
+
+	// The run text is written directly into space reserved for the rest of the row.
+	// Printable ASCII is packed in bulk, unless the run is in the alternate charset.
+	const bool bPackAscii = runAttrs == (runCell.attrs & BitMask(uint16_t,attr_Last));
+	const dim_t maxRun = rep - data;
+	const auto runStart = _ctx.output.size();
+	_ctx.output.resize (runStart + maxRun * (_bUtf8 ? 4 : 1));
+	auto runText = _ctx.output.begin() + runStart;
+	dim_t n = 0;
+	for (;;) {
+	    const dim_t nAscii = bPackAscii ? PackAsciiRun (data, data + (maxRun - n), runCell.Format(), runText) : 0;
+	    runText += nAscii;
+	    data += nAscii;
+	    n += nAscii;
+	    if (n >= maxRun || !data->c || !data->EqualFormat (runCell)
+		    || (dc = CellChar (*data, dattr), dattr != runAttrs))
+		break;
+	    if (_bUtf8)
+		runText = EncodeUtf8 (dc, runText);
+	    else
+		*runText++ = char(dc);
+	    ++n;
+	    ++data;
+	}
+	_ctx.output.resize (distance (_ctx.output.begin(), runText));
+	AdvanceCursor (n);
+	i += n;
+	_stats.m_CellsChanged += n;
+	_stats.m_CellsSent += n;
+    }
+}
+
 //{{{ c_AcscInfo Lineart table -----------------------------------------
 
 // First two values are from the terminfo manpage.
@@ -686,6 +2648,34 @@ const CTerminfo::SAcscInfo CTerminfo::c_AcscInfo [acs_Last] = {
     { 'x', '|', acsv_VLine }
 };
 
+//}}}-------------------------------------------------------------------
+//{{{ c_ProgramCaps and c_MoveCaps precompiled caps tables
+
+const ti::EStrings CTerminfo::c_ProgramCaps [prog_Last] = {
+    ti::cursor_address,		// prog_CursorAddress
+    ti::set_a_foreground,	// prog_SetForeground
+    ti::set_a_background,	// prog_SetBackground
+    ti::set_attributes,		// prog_SetAttributes
+    ti::column_address,		// prog_ColumnAddress
+    ti::row_address,		// prog_RowAddress
+    ti::parm_left_cursor,	// prog_ParmLeftCursor
+    ti::parm_right_cursor,	// prog_ParmRightCursor
+    ti::parm_up_cursor,		// prog_ParmUpCursor
+    ti::parm_down_cursor,	// prog_ParmDownCursor
+    ti::erase_chars,		// prog_EraseChars
+    ti::repeat_char		// prog_RepeatChar
+};
+
+const ti::EStrings CTerminfo::c_MoveCaps [mc_Last] = {
+    ti::carriage_return,	// mc_CarriageReturn
+    ti::cursor_home,		// mc_Home
+    ti::cursor_left,		// mc_Left
+    ti::cursor_right,		// mc_Right
+    ti::cursor_up,		// mc_Up
+    ti::cursor_down,		// mc_Down
+    ti::tab			// mc_Tab
+};
+
 //}}}-------------------------------------------------------------------
 //{{{ c_KeyToStringMap key decoding table
 
@@ -24,10 +24,42 @@ public:
     using keystrings_t	= string;	///< List of key strings corresponding to EKeyDataValue enum.
     using coord_t	= gdt::coord_t;
     using dim_t		= gdt::dim_t;
+    using progargs_t	= tuple<attr_Last,number_t>;	///< Arguments to capability programs.
     static const char no_value[1];
+    /// Flags for Load.
+    enum ELoadFlag {
+	load_Map	= (1 << 0),	///< Use the entry file through a read-only mapping instead of reading it.
+	load_Cache	= (1 << 1),	///< Use and update the decoded entry cache in $XDG_CACHE_HOME/utio.
+	load_Builtin	= (1 << 2),	///< Use the entry compiled into the library, unless a local database has one.
+	load_Utf8	= (1 << 3),	///< Select UTF-8 output if the locale uses it. See SetUtf8.
+	load_Default	= load_Map| load_Builtin
+    };
+    /// Kinds of output counted in SOutputStats.
+    enum EOutputKind {
+	out_Motion,	///< Cursor motion, including reprinted unchanged cells.
+	out_Format,	///< Attributes and colors.
+	out_Text,	///< Cell contents.
+	out_Erase,	///< Cells erased or repeated with a cap.
+	out_Other,	///< Other caps, like scroll and frame sequences.
+	out_Last
+    };
+    /// Output counters kept by CTerminfo. See Stats.
+    struct SOutputStats {
+	uint64_t	m_Bytes [out_Last];	///< Bytes output, by kind.
+	uint64_t	m_CellsChanged;	///< Cells drawn by Image.
+	uint64_t	m_CellsSent;	///< Cells written as characters, including reprinted ones.
+	uint64_t	m_Programs;	///< Cap programs run for the output, not those only run to compare costs.
+	uint32_t	m_Frames;	///< Frames ended by EndFrame, and Image calls outside them.
+	uint32_t	m_LastFrameBytes;	///< Output of the last frame.
+	uint32_t	m_MaxFrameBytes;	///< Output of the largest frame.
+	inline uint64_t	TotalBytes (void) const	{ return accumulate (m_Bytes, m_Bytes + out_Last, uint64_t(0)); }
+    };
 public:
 			CTerminfo (void);
-    void		Load (const char* termname = nullptr);
+			~CTerminfo (void)	{ Unload(); }
+			CTerminfo (const CTerminfo&) = delete;
+    void		operator= (const CTerminfo&) = delete;
+    void		Load (const char* termname = nullptr, unsigned flags = load_Default);
     void		LoadEntry (memblock& buf, const char* termname = nullptr) const;
     strout_t		MoveTo (coord_t x, coord_t y) const;
     strout_t		Color (EColor fg, EColor bg = color_Preserve) const;
@@ -36,13 +68,19 @@ public:
     capout_t		AttrOff (EAttribute a) const;
     strout_t		Attrs (uint16_t a) const;
     capout_t		AllAttrsOff (void) const;
-    inline capout_t	HideCursor (void) const			{ return GetString (ti::cursor_invisible); }
-    inline capout_t	ShowCursor (void) const			{ return GetString (ti::cursor_normal); }
-    strout_t		Image (coord_t x, coord_t y, dim_t w, dim_t h, const CCharCell* data) const;
+    inline capout_t	HideCursor (void) const			{ _ctx.bCursorHidden = true; return GetString (ti::cursor_invisible); }
+    inline capout_t	ShowCursor (void) const			{ _ctx.bCursorHidden = false; return GetString (ti::cursor_normal); }
+    strout_t		BeginFrame (void) const;
+    strout_t		EndFrame (void) const;
+    strout_t		Image (coord_t x, coord_t y, dim_t w, dim_t h, const CCharCell* data, const CCharCell* shown = nullptr, const SCellStyle* styles = nullptr) const;
+    strout_t		Image (const gdt::spans_t& spans, dim_t w, dim_t h, const CCharCell* data, const CCharCell* shown = nullptr, const SCellStyle* styles = nullptr) const;
+    strout_t		Image (const gdt::spans_t& spans, dim_t w, dim_t h, const wchar_t* chars, const uint32_t* formats, const wchar_t* shownChars = nullptr, const uint32_t* shownFormats = nullptr, const SCellStyle* styles = nullptr) const;
     strout_t		Box (coord_t x, coord_t y, dim_t w, dim_t h) const;
     strout_t		Bar (coord_t x, coord_t y, dim_t w, dim_t h, char c = ' ') const;
     strout_t		HLine (coord_t x, coord_t y, dim_t w) const;
     strout_t		VLine (coord_t x, coord_t y, dim_t h) const;
+    bool		CanScroll (void) const;
+    strout_t		Scroll (coord_t top, coord_t bottom, coord_t n) const;
     capout_t		Reset (void) const;
     void		ResetState (void) const;
     inline strout_t	Name (void) const			{ return _name; }
@@ -51,74 +89,249 @@ public:
     inline size_t	Colors (void) const			{ return _nColors; }
     inline size_t	ColorPairs (void) const			{ return _nPairs; }
     inline char		AcsChar (EGraphicChar c) const		{ return _acsMap[c]; }
+    inline bool		Utf8 (void) const			{ return _bUtf8; }
+    inline void		SetUtf8 (bool v)			{ _bUtf8 = v; }
+    inline bool		DirectColor (void) const		{ return _bDirectColor; }
+    inline void		SetDirectColor (bool v)			{ _bDirectColor = v; _formatCache.clear(); }
+    inline bool		SyncUpdate (void) const			{ return _bSyncUpdate; }
+    inline void		SetSyncUpdate (bool v)			{ _bSyncUpdate = v; }
+    static capout_t	SyncUpdateProbe (void);
+    float		FormatCacheHitRate (void) const;
+    inline SOutputStats	Stats (void) const			{ return _stats; }
+    inline void		ResetStats (void) const			{ _stats = SOutputStats(); }
     bool		GetBool (ti::EBooleans i) const;
     number_t		GetNumber (ti::ENumbers i) const;
     capout_t		GetString (ti::EStrings i) const;
+    capout_t		GetExtString (const char* name) const;
+    void		RunStringProgram (const char* program, rstrbuf_t result, progargs_t args) const;
+    void		RunProgram (ti::EStrings i, rstrbuf_t result, progargs_t args) const;
     wchar_t		SubstituteChar (wchar_t c) const;
+    wchar_t		CellRendition (const CCharCell& cell, const SCellStyle* styles, uint16_t& attrs, color_t& fg, color_t& bg) const;
     void		LoadKeystrings (keystrings_t& ksv) const;
     void		Update (void);
     void		read (istream& is);
     void		write (ostream& os) const;
     size_t		stream_size (void) const;
 private:
-    using boolvec_t	= vector<int8_t>;
-    using numvec_t	= vector<number_t>;
     using stroffset_t	= uint16_t;
-    using stroffvec_t	= vector<stroffset_t>;
-    using strtable_t	= string;
-    using progvalue_t	= unsigned long;
+    using progvalue_t	= long;
     using progstack_t	= vector<progvalue_t>;
     using acsmap_t	= tuple<acs_Last,char>;
-    using progargs_t	= tuple<attr_Last,number_t>;
+    /// String caps precompiled into bytecode by CompilePrograms.
+    enum EProgram {
+	prog_CursorAddress,
+	prog_SetForeground,
+	prog_SetBackground,
+	prog_SetAttributes,
+	prog_ColumnAddress,
+	prog_RowAddress,
+	prog_ParmLeftCursor,
+	prog_ParmRightCursor,
+	prog_ParmUpCursor,
+	prog_ParmDownCursor,
+	prog_EraseChars,
+	prog_RepeatChar,
+	prog_Last
+    };
+    /// Fixed cursor motion caps with costs cached in _moveCosts.
+    enum EMoveCap {
+	mc_CarriageReturn,
+	mc_Home,
+	mc_Left,
+	mc_Right,
+	mc_Up,
+	mc_Down,
+	mc_Tab,
+	mc_Last
+    };
+    using progcode_t	= vector<uint8_t>;
+    using progoffs_t	= tuple<prog_Last,uint16_t>;
+    using progvars_t	= tuple<52,progvalue_t>;
+    using movecosts_t	= tuple<mc_Last,uint8_t>;
+    enum {
+	acsl_PageBits = 6,
+	acsl_PageSize = 1 << acsl_PageBits,
+	acsl_Altcharset = 0x80	///< Set in _acsLookup entries from acsc.
+    };
     /// Structure for describing alternate character set values.
     struct SAcscInfo {
 	char		m_vt100Code;	///< vt100 code for this character.
 	char		m_Default;	///< Default value, if the terminfo does not specify.
 	uint16_t	m_Unicode;	///< Unicode equivalent character value.
     };
+    /// Terminfo entry compiled into the library.
+    struct SBuiltinEntry {
+	const char*	m_Name;		///< Terminal name, nullptr for the terminator.
+	const uint8_t*	m_Data;		///< Compiled entry.
+	size_t		m_Size;		///< Size of m_Data.
+    };
+    struct SCacheHeader;
+    class COutputCount;
+    enum {
+	fcache_Size = 64,	///< Number of entries in _formatCache.
+	fcache_MaxCode = 96	///< Longest cached format change sequence.
+    };
+    /// Format change written by Image, cached in _formatCache.
+    struct SFormatChange {
+	color_t		m_FromFg;	///< Colors and attributes changed from.
+	color_t		m_FromBg;
+	uint16_t	m_FromAttrs;
+	uint16_t	m_ToAttrs;	///< Attributes changed to, UINT16_MAX if the entry is unused.
+	color_t		m_ToFg;		///< Colors changed to.
+	color_t		m_ToBg;
+	color_t		m_ResultFg;	///< Resulting _ctx colors; different from m_To* for colorv_Keep.
+	color_t		m_ResultBg;
+	uint8_t		m_CodeSize;	///< Number of bytes in m_Code.
+	char		m_Code [fcache_MaxCode];	///< The escape sequence.
+    };
 private:
     static const SAcscInfo	c_AcscInfo [acs_Last];		///< Codes for all ACS characters.
     static const int16_t	c_KeyToStringMap [kv_nKeys];
+    static const SBuiltinEntry	c_BuiltinEntries [];		///< Entries compiled into the library.
+    static const ti::EStrings	c_ProgramCaps [prog_Last];	///< Caps compiled into _progCode.
+    static const ti::EStrings	c_MoveCaps [mc_Last];		///< Caps costed in _moveCosts.
     /// Current terminal state.
     class CContext {
     public:
 			CContext (void);
     public:
 	string		output;		///< Output string buffer.
+	string		scratch;	///< Temporary buffer for measuring cap costs.
 	progstack_t	progStack;	///< Stack for running ti programs.
+	progvars_t	progVars;	///< %P and %g variables of compiled programs.
 	gdt::Point2d	pos;		///< Current cursor position.
+	gdt::Rect	shownArea;	///< Screen area of shown.
+	const CCharCell* shown;		///< Current screen contents, if known, for reprinting.
+	vector<CCharCell> cells;	///< A span of planes, as cells, in Image.
+	vector<CCharCell> shownCells;	///< A row of shown planes, as cells, in Image.
+	const SCellStyle* styles;	///< Style table of styled cells in Image.
 	uint16_t	attrs;		///< Text attributes.
-	uint8_t		fg;		///< Foreground (text) color.
-	uint8_t		bg;		///< Background color.
+	color_t		fg;		///< Foreground (text) color.
+	color_t		bg;		///< Background color.
+	bool		bCursorHidden;	///< Set by HideCursor, cleared by ShowCursor.
+	bool		bFrameHidCursor;	///< BeginFrame hid the cursor, so EndFrame shows it.
+	bool		bInFrame;	///< Between BeginFrame and EndFrame.
+	uint64_t	frameStart;	///< Total output bytes at BeginFrame.
+	size_t		nCounted;	///< Bytes counted by COutputCount, for excluding nested counts.
+    };
+    /// Index of the entry files in the terminfo search path.
+    ///
+    /// Each first-letter directory is listed once on first use, in both
+    /// the plain and the hashed hex layouts, so lookups of names present
+    /// or absent in it need no further filesystem access.
+    ///
+    class CEntryIndex {
+    public:
+	bool		Find (string& path, const char* termname);
+	void		AddAliases (const char* names, const char* path);
+	void		DirStamps (const char* letters, vector<uint64_t>& stamps);
+    private:
+	/// An entry file, or an alias of one.
+	struct SEntry {
+	    uint32_t	m_Name;		///< Offset of the name in _pool.
+	    uint32_t	m_File;		///< Offset of the file name in _pool.
+	    uint32_t	m_Dir;		///< Index of the file directory in _dirs.
+	};
+	void		LoadSearchPath (void);
+	void		ScanDir (const char* dir);
+	uoff_t		LowerBound (const char* name) const;
+	uint32_t	AddName (const char* name, size_t n);
+	void		Add (const char* name, size_t n, uint32_t file, uint32_t dir);
+    private:
+	string		_pool;		///< Null-terminated names.
+	vector<SEntry>	_entries;	///< Sorted by name.
+	vector<string>	_dirs;		///< Directories containing entry files.
+	vector<string>	_searchPath;	///< Terminfo database directories, in order of preference.
+	bitset<256>	_scanned;	///< First letters whose directories were listed.
     };
 public:
     static inline wchar_t AcsUnicodeValue (EGraphicChar c)	{ return c_AcscInfo[c].m_Unicode; }
 private:
+    static const SBuiltinEntry*	BuiltinEntry (const char* termname);
+    const SBuiltinEntry* ResolveEntry (string& path, const char* termname, bool bBuiltin) const;
+    void		MapEntry (const char* path);
+    void		LinkEntry (const void* p, size_t n);
+    bool		LoadCache (const char* termname);
+    void		SaveCache (const char* termname, const char* srcPath) const;
+    void		Unload (void);
     void		CacheFrequentValues (void);
+    void		DecodeAcs (void);
+    inline uint8_t	AcsLookup (wchar_t c) const;
     void		ObtainTerminalParameters (void);
+    void		SyncUpdateCode (bool bBegin, rstrbuf_t s) const;
+    void		CountFrame (uint64_t n) const;
     void		NormalizeColor (EColor& fg, EColor& bg, uint16_t& attrs) const;
     void		NColor (EColor fg, EColor bg, rstrbuf_t s) const;
+    void		StyleColor (color_t fg, color_t bg, rstrbuf_t s) const;
+    void		ColorCode (color_t c, bool bBackground, rstrbuf_t s) const;
+    color_t		TerminalColor (color_t c) const;
     void		MoveTo (coord_t x, coord_t y, rstrbuf_t s) const;
+    void		MoveCursor (coord_t x, coord_t y, rstrbuf_t s) const;
+    void		RepeatCap (ti::EStrings cap, ti::EStrings parmCap, dim_t n, rstrbuf_t s) const;
+    void		AdvanceCursor (dim_t n = 1) const;
+    bool		RepeatCells (wchar_t dc, dim_t n, bool bToEol, rstrbuf_t s) const;
+    wchar_t		CellChar (const CCharCell& cell, uint16_t& attrs) const;
+    void		CellFormat (const CCharCell& cell, uint16_t& attrs, color_t& fg, color_t& bg) const;
+    void		ImageStart (const CCharCell* shown, const gdt::Rect& shownArea, const SCellStyle* styles) const;
+    strout_t		ImageEnd (uint16_t attrs, color_t fg, color_t bg) const;
+    void		ImageCells (coord_t x, coord_t y, const CCharCell* data, const CCharCell* dataEnd) const;
+    wchar_t		CellOutput (const CCharCell& cell, uint16_t& attrs, color_t& fg, color_t& bg) const;
     void		Color (EColor fg, EColor bg, rstrbuf_t s) const;
     void		Attrs (uint16_t a, rstrbuf_t s) const;
-    void		RunStringProgram (const char* program, string& result, progargs_t args) const;
+    void		Format (uint16_t attrs, color_t fg, color_t bg, rstrbuf_t s) const;
+    void		CompilePrograms (void);
+    static void		CompileStringProgram (const char* program, progcode_t& code);
+    static bool		ValidPrograms (const uint8_t* code, size_t n, const uint16_t* offsets);
+    void		RunProgram (EProgram p, rstrbuf_t result, progargs_t args) const;
+    void		ExecProgram (EProgram p, rstrbuf_t result, progargs_t args) const;
+    size_t		ProgramCost (EProgram p, progargs_t args) const;
     progvalue_t		PSPop (void) const;
     inline progvalue_t	PSPopNonzero (void) const	{ auto v (PSPop()); return v ? v : 1; }
     void		PSPush (progvalue_t v) const;
 private:
     string		_name;		///< Name of the terminfo entry.
-    boolvec_t		_booleans;	///< Boolean caps.
-    numvec_t		_numbers;	///< Numeric caps.
-    stroffvec_t		_stringOffsets;	///< String caps (offsets into _stringTable)
-    strtable_t		_stringTable;	///< Actual string caps values.
+    cmemlink		_entry;		///< The compiled entry, in _entryBuf or _mapping.
+    memblock		_entryBuf;	///< Storage for _entry when it is read instead of mapped.
+    cmemlink		_mapping;	///< The mapped entry or cache file.
+    cmemlink		_cachedKeymap;	///< Keymap loaded from the cache file.
+    const int8_t*	_booleans;	///< Boolean caps.
+    const number_t*	_numbers;	///< Numeric caps, little-endian.
+    const stroffset_t*	_stringOffsets;	///< String caps (little-endian offsets into _stringTable)
+    const char*		_stringTable;	///< Actual string caps values.
+    capout_t		_syncCap;	///< The Sync extended cap, looked up on load.
+    uint16_t		_nBooleans;	///< Number of entries in _booleans.
+    uint16_t		_nNumbers;	///< Number of entries in _numbers.
+    uint16_t		_nStrings;	///< Number of entries in _stringOffsets.
+    uint16_t		_stringTableSize;	///< Size of _stringTable in bytes.
     acsmap_t		_acsMap;	///< Decoded ACS characters.
+    vector<uint8_t>	_acsLookup;	///< Two-level table of _acsMap by Unicode value; see DecodeAcs.
+    uint16_t		_acsPages;	///< Number of pages in the _acsLookup page index.
+    progcode_t		_progCode;	///< Bytecode of compiled string caps.
+    progoffs_t		_progOffsets;	///< Offsets of each EProgram in _progCode.
+    movecosts_t		_moveCosts;	///< Byte costs of c_MoveCaps, 0 if unusable.
+    mutable CEntryIndex	_index;		///< Entry files in the search path.
     mutable CContext	_ctx;		///< Current state of the terminal.
+    mutable vector<SFormatChange> _formatCache;	///< Format changes hashed by Format, empty when invalidated.
+    mutable uint32_t	_nFormatLookups;	///< Format changes looked up in _formatCache.
+    mutable uint32_t	_nFormatHits;	///< Format changes found in _formatCache.
+    mutable SOutputStats _stats;	///< Output counters.
     uint16_t		_nColors;	///< Number of available colors.
     uint16_t		_nPairs;	///< Number of available color pairs (unused).
     dim_t		_nColumns;	///< Number of display columns.
     dim_t		_nRows;		///< Number of display rows.
+    dim_t		_tabSize;	///< Distance between hardware tab stops, 0 if none.
+    bool		_bUtf8;		///< Image writes Unicode text in UTF-8 instead of ACS.
+    bool		_bDirectColor;	///< The terminal accepts 24-bit SGR colors.
+    bool		_bSyncUpdate;	///< The terminal supports synchronized updates (DEC mode 2026).
 };
 
+/// Returns the ACS lookup entry for \p c, or 0 if it is not an ACS character.
+inline uint8_t CTerminfo::AcsLookup (wchar_t c) const
+{
+    const size_t page = size_t(c) >> acsl_PageBits;
+    return page < _acsPages ? _acsLookup [_acsPages + _acsLookup[page] * acsl_PageSize + size_t(c) % acsl_PageSize] : 0;
+}
+
 } // namespace utio
 
 STD_STREAMABLE (utio::CTerminfo);
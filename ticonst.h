@@ -58,11 +58,38 @@ enum EAttribute {
     a_italic,
     a_subscript,
     a_superscript,
-    attr_Last
+    attr_Last,
+    a_styled = 15	///< fg and bg hold a style index. See CCharCell::StyleIndex.
+};
+
+/// Full color value of a cell style: 24-bit 0xRRGGBB, or one of #EColorValue.
+using color_t = uint32_t;
+
+/// Special color_t values.
+enum EColorValue : color_t {
+    colorv_Indexed	= 1u << 24,	///< Flag for a terminal palette index in the low 8 bits.
+    colorv_Default	= 2u << 24,	///< The default color of the terminal.
+    colorv_Keep		= 3u << 24	///< Keep the current color.
+};
+
+/// Returns the color_t for \p r, \p g, \p b.
+inline constexpr color_t RGBColor (uint8_t r, uint8_t g, uint8_t b)
+    { return (color_t(r) << 16) | (color_t(g) << 8) | b; }
+/// Returns the color_t for terminal palette entry \p i, with the EColor values in the first 16.
+inline constexpr color_t IndexedColor (uint8_t i)
+    { return colorv_Indexed | i; }
+
+/// Colors and attributes of styled cells, interned by CGC::Style.
+struct SCellStyle {
+    color_t	fg;	///< Foreground color.
+    color_t	bg;	///< Background color.
+    uint16_t	attrs;	///< Attribute bits. See #EAttribute for values.
+    inline bool	operator== (const SCellStyle& v) const	{ return fg == v.fg && bg == v.bg && attrs == v.attrs; }
 };
 
 //----------------------------------------------------------------------
 
+/// A character cell. With a_styled in attrs, fg and bg hold an index into the CGC style table instead of colors.
 struct SCharCell {
     wchar_t	c;	///< The character.
     uint8_t	fg;	///< Foreground color. See #EColor for values.
@@ -78,14 +105,20 @@ public:
     inline	CCharCell (wchar_t nv = ' ', EColor nfg = lightgray, EColor nbg = color_Preserve, uint16_t nattrs = 0)
 		    { c = nv; fg = nfg; bg = nbg; attrs = nattrs; }
     inline	CCharCell (const SCharCell& sc);
+		CCharCell (rcself_t v) = default;
     inline	CCharCell (wchar_t v, rcself_t t);
     inline bool	EqualFormat (rcself_t v) const
 		    { return *noalias_cast<const uint32_t*>(&fg) == *noalias_cast<const uint32_t*>(&v.fg); }
+    inline uint32_t Format (void) const		{ uint32_t f; memcpy (&f, &fg, sizeof(f)); return f; }
+    inline void	SetFormat (uint32_t f)		{ memcpy (&fg, &f, sizeof(f)); }
     inline bool	operator== (rcself_t v) const;
     inline void	operator= (rcself_t v);
     inline bool	HasAttr (EAttribute a) const	{ return attrs & (1 << a); }
     inline void	SetAttr (EAttribute a)		{ attrs |= (1 << a); }
     inline void	ClearAttr (EAttribute a)	{ attrs &= ~(1 << a); }
+    inline bool	IsStyled (void) const		{ return HasAttr (a_styled); }
+    inline uint16_t StyleIndex (void) const	{ return fg | (bg << 8); }
+    inline void	SetStyleIndex (uint16_t s)	{ fg = s; bg = s >> 8; SetAttr (a_styled); }
 };
 
 //{{{ CCharCell inlines implementation
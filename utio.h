@@ -6,3 +6,7 @@
 #pragma once
 #include "utio/kb.h"
 #include "utio/gc.h"
+#include "utio/out.h"
+#include "utio/screen.h"
+#include "utio/vt.h"
+#include "utio/layers.h"
@@ -0,0 +1,398 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "vt.h"
+
+namespace utio {
+
+//----------------------------------------------------------------------
+
+/// Constructs a \p w by \p h screen.
+CVtModel::CVtModel (dim_t w, dim_t h)
+:_cells()
+,_partial()
+,_size (0, 0)
+,_pos (0, 0)
+,_savedPos (0, 0)
+,_pen()
+,_savedPen()
+,_top (0)
+,_bottom (0)
+,_lastChar (' ')
+,_bWrapPending (false)
+,_bAutoWrap (true)
+,_bCursorVisible (true)
+,_bShifted (false)
+,_bGraphics { false, false }
+{
+    Resize (w, h);
+}
+
+/// Resizes the screen to \p w by \p h and resets it.
+void CVtModel::Resize (dim_t w, dim_t h)
+{
+    _size = Size2d (w, h);
+    Reset();
+}
+
+/// Resets the terminal state and clears the screen, like RIS.
+void CVtModel::Reset (void)
+{
+    _pen = SCell { ' ', 0, colorv_Default, colorv_Default };
+    _savedPen = _pen;
+    _cells.assign (Width() * Height(), _pen);
+    _partial.clear();
+    _pos = _savedPos = Point2d (0, 0);
+    _top = 0;
+    _bottom = Height();
+    _lastChar = ' ';
+    _bWrapPending = false;
+    _bAutoWrap = true;
+    _bCursorVisible = true;
+    _bShifted = false;
+    _bGraphics[0] = _bGraphics[1] = false;
+}
+
+//----------------------------------------------------------------------
+
+/// Applies \p n bytes of output at \p p to the screen.
+void CVtModel::Write (const char* p, size_t n)
+{
+    _partial.append (p, n);
+    size_t i = 0;
+    for (size_t used; i < _partial.size() && (used = Parse (_partial.iat(i), _partial.size() - i)); i += used) {}
+    _partial.erase (_partial.begin(), i);
+}
+
+/// Interprets the character or sequence at \p p. Returns its size, or 0 if it is incomplete.
+size_t CVtModel::Parse (const char* p, size_t n)
+{
+    const uint8_t c = *p;
+    if (c == '\033')
+	return Escape (p, n);
+    if (c >= 0x80) {
+	const size_t sl = Utf8SequenceBytes (c);
+	if (sl > n)
+	    return 0;
+	Print (*utf8in(p));
+	return sl;
+    }
+    switch (c) {
+	case '\b':	MoveTo (_pos[0] - 1, _pos[1]);		break;
+	case '\t':	MoveTo (min (Align (_pos[0] + 1, 8), Width() - 1), _pos[1]);	break;
+	case '\n':	MoveTo (0, _pos[1]);	// onlcr of the tty makes it CR LF
+			[[fallthrough]];
+	case '\v':
+	case '\f':	LineFeed();				break;
+	case '\r':	MoveTo (0, _pos[1]);			break;
+	case '\016':	_bShifted = true;			break;
+	case '\017':	_bShifted = false;			break;
+	default:	if (c >= ' ' && c < 0x7f)
+			    Print (c);
+			break;
+    }
+    return 1;
+}
+
+/// Interprets the escape sequence at \p p.
+size_t CVtModel::Escape (const char* p, size_t n)
+{
+    if (n < 2)
+	return 0;
+    switch (p[1]) {
+	case '[':	return ControlSequence (p, n);
+	case ']':	// OSC, DCS, and other strings end with ST or BEL
+	case 'P':
+	case '_':
+	case '^':	for (size_t i = 2; i < n; ++i) {
+			    if (p[i] == '\a')
+				return i + 1;
+			    if (p[i] == '\033' && i + 1 < n)
+				return i + 2;
+			}
+			return 0;
+	case '(':
+	case ')':	if (n < 3)
+			    return 0;
+			_bGraphics [p[1] == ')'] = p[2] == '0';
+			return 3;
+	case '#':
+	case '%':
+	case ' ':	return n < 3 ? 0 : 3;
+	case '7':	_savedPos = _pos;
+			_savedPen = _pen;			break;
+	case '8':	_pen = _savedPen;
+			MoveTo (_savedPos[0], _savedPos[1]);	break;
+	case 'D':	LineFeed();				break;
+	case 'E':	MoveTo (0, _pos[1]);
+			LineFeed();				break;
+	case 'M':	ReverseIndex();				break;
+	case 'c':	Reset();				break;
+    }
+    return 2;
+}
+
+/// Interprets the control sequence at \p p.
+size_t CVtModel::ControlSequence (const char* p, size_t n)
+{
+    unsigned a [16] = {}, na = 0;
+    size_t i = 2;
+    const char prefix = (i < n && strchr ("?>=<", p[i])) ? p[i++] : 0;
+    for (; i < n && (isdigit (p[i]) || p[i] == ';' || p[i] == ':'); ++i) {
+	if (!isdigit (p[i]))
+	    ++na;
+	else if (na < VectorSize(a))
+	    a[na] = a[na] * 10 + p[i] - '0';
+    }
+    if (i > 2 + !!prefix)
+	na = min (na + 1, unsigned(VectorSize(a)));
+    const size_t interStart = i;
+    for (; i < n && p[i] >= ' ' && p[i] < '0'; ++i) {}
+    if (i >= n)
+	return 0;
+    const char f = p[i++];
+    if (i - 1 > interStart)	// Sequences with intermediates, like DECRQM or DECSCUSR, do not change the screen
+	return i;
+    if (!prefix)
+	Csi (f, a, na);
+    else if (prefix == '?' && (f == 'h' || f == 'l')) {
+	for (unsigned m = 0; m < na; ++m) {
+	    if (a[m] == 7)
+		_bAutoWrap = f == 'h';
+	    else if (a[m] == 25)
+		_bCursorVisible = f == 'h';
+	}
+    }
+    return i;
+}
+
+/// Executes the control function with final byte \p f and \p na parameters \p a.
+void CVtModel::Csi (char f, const unsigned* a, unsigned na)
+{
+    auto arg = [&](unsigned i, unsigned def) { return (i < na && a[i]) ? coord_t (min (a[i], unsigned(INT16_MAX))) : coord_t (def); };
+    const coord_t n = arg (0, 1);
+    const coord_t x = _pos[0], y = _pos[1];
+    const bool bInRegion = y >= _top && y < _bottom;
+    switch (f) {
+	case 'A':	MoveTo (x, max (coord_t(y - n), coord_t(y >= _top ? _top : 0)));	break;
+	case 'B':
+	case 'e':	MoveTo (x, min (coord_t(y + n), coord_t(y < _bottom ? _bottom - 1 : Height() - 1)));	break;
+	case 'C':
+	case 'a':	MoveTo (x + n, y);		break;
+	case 'D':	MoveTo (x - n, y);		break;
+	case 'E':	MoveTo (0, y + n);		break;
+	case 'F':	MoveTo (0, y - n);		break;
+	case 'G':
+	case '`':	MoveTo (n - 1, y);		break;
+	case 'd':	MoveTo (x, n - 1);		break;
+	case 'H':
+	case 'f':	MoveTo (arg (1, 1) - 1, n - 1);	break;
+	case 'J':	switch (arg (0, 0)) {
+			    case 0: Erase (x, y, (Height() - y) * Width() - x);	break;
+			    case 1: Erase (0, 0, y * Width() + x + 1);		break;
+			    default: Erase (0, 0, Height() * Width());		break;
+			}				break;
+	case 'K':	switch (arg (0, 0)) {
+			    case 0: Erase (x, y, Width() - x);		break;
+			    case 1: Erase (0, y, x + 1);		break;
+			    default: Erase (0, y, Width());		break;
+			}				break;
+	case 'X':	Erase (x, y, min (n, coord_t(Width() - x)));	break;
+	case '@': {	const auto row = _cells.begin() + y * Width();
+			const coord_t m = min (n, coord_t(Width() - x));
+			copy_backward (row + x, row + Width() - m, row + Width());
+			fill_n (row + x, m, Blank());
+			break; }
+	case 'P': {	const auto row = _cells.begin() + y * Width();
+			const coord_t m = min (n, coord_t(Width() - x));
+			copy (row + x + m, row + Width(), row + x);
+			fill_n (row + Width() - m, m, Blank());
+			break; }
+	case 'L':	if (bInRegion) {
+			    ScrollRows (y, _bottom, -n);
+			    MoveTo (0, y);
+			}				break;
+	case 'M':	if (bInRegion) {
+			    ScrollRows (y, _bottom, n);
+			    MoveTo (0, y);
+			}				break;
+	case 'S':	ScrollRows (_top, _bottom, n);	break;
+	case 'T':	if (na <= 1)
+			    ScrollRows (_top, _bottom, -n);
+			break;
+	case 'b':	for (coord_t i = 0; i < n; ++i)
+			    Print (_lastChar);
+			break;
+	case 'r': {	const coord_t top = arg (0, 1) - 1, bottom = arg (1, Height());
+			if (top < bottom && bottom <= Height()) {
+			    _top = top;
+			    _bottom = bottom;
+			    MoveTo (0, 0);
+			}
+			break; }
+	case 'm':	Sgr (a, na);			break;
+	case 's':	_savedPos = _pos;		break;
+	case 'u':	MoveTo (_savedPos[0], _savedPos[1]);	break;
+    }
+}
+
+/// Sets the pen from the \p na SGR parameters in \p a.
+void CVtModel::Sgr (const unsigned* a, unsigned na)
+{
+    static const uint8_t c_Attrs[] = {	// Attributes turned on by 1-8 and off by 21-28
+	attr_Last, a_bold, a_halfbright, a_italic, a_underline, a_blink, a_blink, a_reverse, a_invisible
+    };
+    if (!na)
+	na = 1;		// ESC [ m is ESC [ 0 m
+    for (unsigned i = 0; i < na; ++i) {
+	const unsigned v = a[i];
+	if (!v)
+	    _pen = SCell { ' ', 0, colorv_Default, colorv_Default };
+	else if (v == 22)
+	    _pen.attrs &= ~((1 << a_bold) | (1 << a_halfbright));
+	else if (v == 38 || v == 48) {	// 38;5;n or 38;2;r;g;b
+	    color_t c = colorv_Default;
+	    if (i + 2 < na && a[i + 1] == 5) {
+		c = IndexedColor (a[i + 2]);
+		i += 2;
+	    } else if (i + 4 < na && a[i + 1] == 2) {
+		c = RGBColor (a[i + 2], a[i + 3], a[i + 4]);
+		i += 4;
+	    }
+	    (v == 38 ? _pen.fg : _pen.bg) = c;
+	} else if (v == 39)
+	    _pen.fg = colorv_Default;
+	else if (v == 49)
+	    _pen.bg = colorv_Default;
+	else if (v >= 30 && v < 38)
+	    _pen.fg = IndexedColor (v - 30);
+	else if (v >= 40 && v < 48)
+	    _pen.bg = IndexedColor (v - 40);
+	else if (v >= 90 && v < 98)
+	    _pen.fg = IndexedColor (v - 90 + 8);
+	else if (v >= 100 && v < 108)
+	    _pen.bg = IndexedColor (v - 100 + 8);
+	else if (v < VectorSize(c_Attrs))
+	    _pen.attrs |= (1 << c_Attrs[v]);
+	else if (v > 22 && v - 20 < VectorSize(c_Attrs))
+	    _pen.attrs &= ~(1 << c_Attrs[v - 20]);
+    }
+}
+
+//----------------------------------------------------------------------
+
+/// Writes \p c at the cursor and advances it.
+void CVtModel::Print (wchar_t c)
+{
+    if (_bWrapPending && _bAutoWrap) {
+	MoveTo (0, _pos[1]);
+	LineFeed();
+    }
+    _bWrapPending = false;
+    SCell cell (_pen);
+    cell.c = c;
+    if (_bGraphics[_bShifted] && c >= 0x5f && c < 0x7f)
+	cell.attrs |= (1 << a_altcharset);
+    At (_pos[0], _pos[1]) = cell;
+    _lastChar = c;
+    if (_pos[0] + 1 < Width())
+	++_pos[0];
+    else
+	_bWrapPending = true;
+}
+
+/// Moves the cursor down a row, scrolling at the bottom of the scroll region.
+void CVtModel::LineFeed (void)
+{
+    _bWrapPending = false;
+    if (_pos[1] == _bottom - 1)
+	ScrollRows (_top, _bottom, 1);
+    else if (_pos[1] + 1 < Height())
+	++_pos[1];
+}
+
+/// Moves the cursor up a row, scrolling at the top of the scroll region.
+void CVtModel::ReverseIndex (void)
+{
+    _bWrapPending = false;
+    if (_pos[1] == _top)
+	ScrollRows (_top, _bottom, -1);
+    else if (_pos[1] > 0)
+	--_pos[1];
+}
+
+/// Moves the cursor to \p x, \p y, clipped to the screen.
+void CVtModel::MoveTo (coord_t x, coord_t y)
+{
+    _pos[0] = min (max (x, coord_t(0)), coord_t(Width() - 1));
+    _pos[1] = min (max (y, coord_t(0)), coord_t(Height() - 1));
+    _bWrapPending = false;
+}
+
+/// Moves rows [\p top, \p bottom) up by \p n, or down if negative, filling vacated rows with blanks.
+void CVtModel::ScrollRows (coord_t top, coord_t bottom, coord_t n)
+{
+    const coord_t an = min (coord_t (absv (n)), coord_t (bottom - top));
+    const auto first = _cells.begin() + top * Width(), last = _cells.begin() + bottom * Width();
+    const size_t moved = an * Width();
+    if (n > 0) {
+	copy (first + moved, last, first);
+	fill (last - moved, last, Blank());
+    } else {
+	copy_backward (first, last - moved, last);
+	fill (first, first + moved, Blank());
+    }
+}
+
+/// Erases \p n cells starting at \p x, \p y.
+void CVtModel::Erase (coord_t x, coord_t y, size_t n)
+{
+    fill_n (_cells.begin() + y * Width() + x, n, Blank());
+}
+
+//----------------------------------------------------------------------
+
+/// Returns true if the screen shows the cells of \p gc as written by \p ti.
+///
+/// The cells are compared as they look: blanks are compared only by
+/// their background, unless underlined or reversed, standout is shown
+/// in reverse, and the default colors are lightgray on black. The first
+/// differing cell is returned in \p mismatch. Transparent cells of \p gc
+/// are not compared.
+///
+bool CVtModel::Shows (const CGC& gc, const CTerminfo& ti, Point2d* mismatch) const
+{
+    const uint16_t c_Visible = (1 << a_underline) | (1 << a_reverse) | (1 << a_blink) | (1 << a_halfbright)
+			     | (1 << a_bold) | (1 << a_invisible) | (1 << a_italic) | (1 << a_altcharset);
+    auto defaultColor = [](color_t c, EColor d) { return c == IndexedColor (d) ? color_t (colorv_Default) : c; };
+    if (gc.Width() != Width() || gc.Height() != Height())
+	return false;
+    for (coord_t y = 0; y < Height(); ++y) {
+	for (coord_t x = 0; x < Width(); ++x) {
+	    const CCharCell gi (gc.GetCell (Point2d (x, y)));
+	    if (!gi.c)
+		continue;
+	    SCell e;
+	    e.c = ti.CellRendition (gi, gc.Styles().begin(), e.attrs, e.fg, e.bg);
+	    if (e.attrs & (1 << a_standout))
+		e.attrs |= (1 << a_reverse);
+	    if (e.c < 0x5f || e.c >= 0x7f)
+		e.attrs &= ~(1 << a_altcharset);
+	    e.attrs &= c_Visible;
+	    const SCell& s = At (x, y);
+	    const bool bBlank = e.c == ' ' && s.c == ' ' && !((e.attrs | s.attrs) & ((1 << a_underline) | (1 << a_reverse)));
+	    if (defaultColor (e.bg, black) != defaultColor (s.bg, black)
+		|| (!bBlank && (e.c != s.c || e.attrs != s.attrs
+				|| defaultColor (e.fg, lightgray) != defaultColor (s.fg, lightgray)))) {
+		if (mismatch)
+		    *mismatch = Point2d (x, y);
+		return false;
+	    }
+	}
+    }
+    return true;
+}
+
+} // namespace utio
@@ -0,0 +1,80 @@
+// This file is part of the utio library, a terminal I/O library.
+//
+// Copyright (c) 2004 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#pragma once
+#include "ti.h"
+#include "gc.h"
+
+namespace utio {
+
+/// Headless model of an xterm-like terminal screen.
+///
+/// Interprets the ECMA-48 control functions, DEC private modes, and
+/// character sets written for VT100 and xterm descendants, and keeps
+/// the resulting screen contents. It is meant for testing output: bytes
+/// written for a frame are applied to the model, which must then show
+/// the cells of the CGC the frame was drawn from. See Shows. Output is
+/// taken as it leaves the tty driver, with newlines mapped to CR LF.
+///
+class CVtModel {
+public:
+    using coord_t	= gdt::coord_t;
+    using dim_t		= gdt::dim_t;
+    using Point2d	= gdt::Point2d;
+    using Size2d	= gdt::Size2d;
+    /// A screen cell.
+    struct SCell {
+	wchar_t		c;	///< Character; DEC line drawing codes have a_altcharset set.
+	uint16_t	attrs;	///< EAttribute bits set by SGR.
+	color_t		fg;	///< Foreground color, colorv_Default if not set.
+	color_t		bg;	///< Background color, colorv_Default if not set.
+    };
+    using cells_t	= vector<SCell>;
+public:
+    explicit		CVtModel (dim_t w = 80, dim_t h = 24);
+    void		Resize (dim_t w, dim_t h);
+    void		Reset (void);
+    void		Write (const char* p, size_t n);
+    inline CVtModel&	operator<< (const string& s)		{ Write (s.data(), s.size()); return *this; }
+    inline CVtModel&	operator<< (const char* s)		{ Write (s, strlen(s)); return *this; }
+    inline const SCell&	At (coord_t x, coord_t y) const		{ return _cells [y * Width() + x]; }
+    inline const Point2d& Cursor (void) const			{ return _pos; }
+    inline bool		CursorVisible (void) const		{ return _bCursorVisible; }
+    inline dim_t	Width (void) const			{ return _size[0]; }
+    inline dim_t	Height (void) const			{ return _size[1]; }
+    bool		Shows (const CGC& gc, const CTerminfo& ti, Point2d* mismatch = nullptr) const;
+private:
+    inline SCell&	At (coord_t x, coord_t y)		{ return _cells [y * Width() + x]; }
+    size_t		Parse (const char* p, size_t n);
+    size_t		Escape (const char* p, size_t n);
+    size_t		ControlSequence (const char* p, size_t n);
+    void		Csi (char f, const unsigned* a, unsigned na);
+    void		Sgr (const unsigned* a, unsigned na);
+    void		Print (wchar_t c);
+    void		LineFeed (void);
+    void		ReverseIndex (void);
+    void		MoveTo (coord_t x, coord_t y);
+    void		ScrollRows (coord_t top, coord_t bottom, coord_t n);
+    void		Erase (coord_t x, coord_t y, size_t n);
+    inline SCell	Blank (void) const			{ return SCell { ' ', 0, _pen.fg, _pen.bg }; }
+private:
+    cells_t		_cells;		///< Screen contents, row by row.
+    string		_partial;	///< Incomplete sequence at the end of the last Write.
+    Size2d		_size;		///< Screen size.
+    Point2d		_pos;		///< Cursor position.
+    Point2d		_savedPos;	///< Cursor position saved by DECSC.
+    SCell		_pen;		///< Current attributes and colors.
+    SCell		_savedPen;	///< Pen saved by DECSC.
+    coord_t		_top;		///< First row of the scroll region.
+    coord_t		_bottom;	///< Row after the scroll region.
+    wchar_t		_lastChar;	///< Last printed character, for REP.
+    bool		_bWrapPending;	///< The last column was written; the next character wraps.
+    bool		_bAutoWrap;	///< DECAWM
+    bool		_bCursorVisible;	///< DECTCEM
+    bool		_bShifted;	///< SO selected G1.
+    bool		_bGraphics [2];	///< G0 and G1 are DEC line drawing.
+};
+
+} // namespace utio